@@ -6,17 +6,51 @@
 #include <sys/stat.h>
 
 #include <limits.h>
+#include <stdint.h>
 
 /* data */
 
-typedef struct {
-	char fn[PATH_MAX];
+typedef struct watch_file {
+	char *fn;
 	int fd;
 	int is_dir;
 	int is_symlink;
-	int file_count;
+	int settle; /* checks remaining before a directory is reported altered */
+	struct snapshot *snapshot;
 	mode_t mode;
 	ino_t ino;
+	dev_t dev;
+
+	/* directory tree maintained by a recursive walk */
+	int is_tree;      /* directory contents are tracked in place */
+	int is_removed;   /* released at the end of the current pass */
+	int is_allocated; /* freed rather than returned to the arena */
+	int is_queued;    /* waiting for a directory scan or content check */
+	unsigned scan;    /* last scan that found this entry */
+	struct watch_file *parent;
+	struct watch_file *child;
+	struct watch_file *next;
+
+	/* a file that was removed is opened again when it reappears */
+	int reopen;    /* checks remaining before the file is considered absent */
+	int is_absent; /* checked again when an enclosing directory changes */
+	int is_parent; /* a directory watched only for absent files */
+
+	/* checked using stat(2) if changes are not reported by the kernel */
+	int poll; /* slot in the list of polled files, or -1 */
+
+	/* directory record kept by the fanotify backend */
+	void *fan_dir;
+
+	/* fingerprint used to skip writes that leave the contents unchanged */
+	int has_digest;
+	off_t size;
+	struct timespec mtime;
+	uint64_t digest;
+
+	/* entry in the persistent index, or -1 */
+	int index_entry;
+	int is_stale; /* recorded in the index when the utility is run */
 } WatchFile;
 
 /* defined in entr.c */
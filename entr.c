@@ -5,6 +5,12 @@
 
 #include <sys/param.h>
 #include <sys/resource.h>
+#if defined(_LINUX_PORT)
+#include <linux/magic.h>
+#include <sys/statfs.h>
+#else
+#include <sys/mount.h>
+#endif
 #include <sys/stat.h>
 #include <sys/sysctl.h>
 #include <sys/wait.h>
@@ -15,11 +21,16 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
 #include <paths.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,42 +41,305 @@
 #include "missing/compat.h"
 
 #include "data.h"
+#include "hash.h"
+#include "index.h"
+#include "snapshot.h"
 #include "status.h"
+#include "trace.h"
 
 /* events to watch for */
 
 #define NOTE_ALL NOTE_DELETE | NOTE_WRITE | NOTE_RENAME | NOTE_TRUNCATE | NOTE_ATTRIB
 
+/* allocation size for file records and path names */
+
+#define ARENA_CHUNK (64 * 1024)
+
+/* bounds for the number of events read in one pass of the watch loop */
+
+#define EV_LIST_MIN 32
+#define EV_LIST_MAX 65536
+
+/* directories are compared again at an interval until they settle */
+
+#define SETTLE_TIMER 1
+#define SETTLE_INTERVAL 100 /* ms */
+#define SETTLE_CHECKS 5
+
+/* wait for a quiet period before running the utility */
+
+#define DEBOUNCE_TIMER 2
+
+/* files that are removed are opened again at an interval until they reappear */
+
+#define REOPEN_TIMER 4
+#define REOPEN_INTERVAL 100 /* ms */
+#define REOPEN_CHECKS 10
+
+/* time allowed for the utility to exit before it is killed */
+
+#define RESTART_TIMER 3
+#define RESTART_TIMEOUT 5000 /* ms */
+
+/* files on file systems that do not report changes are checked using stat(2) */
+
+#define POLL_TIMER 5
+#define POLL_INTERVAL 500 /* ms */
+#define POLL_BACKOFF 8    /* the interval grows to this multiple while quiet */
+#define POLL_LOAD 10      /* the interval is at least this multiple of the scan time */
+#define POLL_FD -2        /* stands in for the descriptor of a polled file */
+
+/* ENTR_POLL */
+#define POLL_AUTO 0
+#define POLL_ALL 1
+#define POLL_NONE 2
+
+/* files are fingerprinted as they are read into a buffer of this size */
+
+#define FINGERPRINT_BUF (64 * 1024)
+
+/* routes run at the same time, each in its own process group */
+
+#define JOBS_MAX 32
+
+/* resource usage reported for each run; ru_maxrss is in bytes on macOS */
+
+#define TIMEVAL_US(tv) ((uint64_t) (tv).tv_sec * 1000000 + (tv).tv_usec)
+#if defined(_MACOS_PORT)
+#define MAXRSS_KB(ru) ((ru)->ru_maxrss / 1024)
+#else
+#define MAXRSS_KB(ru) ((ru)->ru_maxrss)
+#endif
+
+/* reasons a file could not be watched */
+
+#define WATCH_OPEN 1
+#define WATCH_REGISTER 2
+
+/* parallel ingestion */
+
+#define WORK_THREADS_MAX 16
+#define WORK_BATCH 256
+
+typedef struct {
+	pthread_t thread[WORK_THREADS_MAX];
+	int n_threads;
+	pthread_mutex_t lock;
+	int next;
+	int n;
+	void (*fn)(int, void *);
+	void *arg;
+	int failed; /* first item that could not be processed, or -1 */
+	int status;
+	int error;
+} WorkQueue;
+
+typedef struct {
+	WatchFile *file;
+	int changed;
+} ContentCheck;
+
+typedef struct {
+	WatchFile *file;
+	ino_t ino;
+	mode_t mode;
+	off_t size;
+	struct timespec mtime;
+	u_int fflags; /* changes found by the last scan */
+} PollFile;
+
+typedef struct {
+	dev_t dev;
+	int polled;
+} FileSystem;
+
+typedef struct {
+	size_t off; /* offset of the path in the input text */
+	char *path;
+	int error;
+	mode_t mode;
+	ino_t ino;
+	dev_t dev;
+	off_t size;
+	struct timespec mtime;
+} InputPath;
+
+typedef struct {
+	char **path;
+	int n;
+	int size;
+} PathList;
+
+typedef struct {
+	char *command;
+	char *name;     /* reported by the status filter */
+	PathList paths; /* matching paths not yet passed to the command */
+	int pending;
+	pid_t pid;
+	uint64_t start_us;
+} Route;
+
+typedef struct {
+	char *pattern;
+	int route;
+} RoutePattern;
+
 /* shared state */
 
 extern int optind;
+extern char **environ;
 pid_t status_pid;
 WatchFile **files;
 
 /* globals */
 
+FileTable path_table;
+FileTable inode_table;
+int n_files;
 WatchFile *leading_edge;
 int child_pid;
 int child_status;
+struct rusage child_usage;
+uint64_t child_wall_us;
 int terminating;
+volatile sig_atomic_t exit_signal; /* handled by the watch loop */
+volatile sig_atomic_t watching;    /* the utility may have been started */
+int signal_pipe[2] = { -1, -1 };
 int restart_signal;
+int restart_timeout_ms;
+int run_pending;  /* run again once the utility has exited */
+int stopping;     /* the utility has been signaled to exit */
+int child_exited; /* reaped once the events received with it are processed */
+int debounce_ms;
+int debounce_max_ms;
+struct timespec debounce_start; /* first change not yet acted on */
 
 int aggressive_opt;
 int clear_opt;
 int dirwatch_opt;
+int follow_opt;
+int identical_opt;
+int list_opt;
 int noninteractive_opt;
 int oneshot_opt;
 int postpone_opt;
+int recursive_opt;
 int restart_opt;
 int shell_opt;
 int status_filter_opt;
+int table_opt;
+int trace_opt; /* EV_TRACE */
+int worker_opt;
+
+int track_changed; /* paths are recorded for -l, -t or -w */
 
 int termios_set;
 struct termios canonical_tty;
 
+WorkQueue register_queue;
+WorkQueue check_queue;
+
+/* event batches read by the watch loop */
+struct kevent *evList;
+int ev_size;
+struct {
+	unsigned long calls;   /* calls to kevent(2) */
+	unsigned long batches; /* passes of the watch loop with events */
+	unsigned long events;
+	int max_batch;
+} batch_stats;
+
+/* counters and timings reported by the structured trace */
+struct {
+	unsigned long runs;
+	unsigned long deferred;  /* runs postponed by the debounce */
+	unsigned long unchanged; /* writes that left the contents unchanged */
+	unsigned long collated;  /* passes spent waiting for files to reappear */
+	Histogram latency;       /* first change to fork */
+	Histogram runtime;       /* fork to exit */
+	Histogram scan;          /* time taken to check polled files */
+} trace_stats;
+uint64_t change_us; /* receipt of the first change not yet acted on */
+uint64_t run_us;    /* start of the current run */
+uint64_t stop_us;   /* the utility was signaled to restart */
+
+/* input lines waiting to be processed */
+InputPath *input;
+int n_input, input_size;
+char *text;
+size_t text_len, text_size;
+int input_fd = -1;
+int max_files;
+
+/* directories scanned and entries pruned during one pass of the watch loop */
+WatchFile **scan_list;
+int n_scan, scan_size;
+WatchFile **removed;
+int n_removed, removed_size;
+unsigned scan_generation;
+
+/* paths changed since the utility was last run */
+PathList changed;
+
+/* messages written to a persistent utility */
+int worker_fd = -1;
+char *worker_buf;
+size_t worker_len, worker_off, worker_size;
+unsigned long worker_seq;
+int worker_polling; /* waiting for the pipe to be writable */
+int worker_held;    /* changes wait until earlier messages are read */
+
+/* commands selected by the paths that change */
+Route *routes;
+int n_routes;
+RoutePattern *patterns;
+int n_patterns;
+int max_jobs;
+int n_jobs;
+int next_route; /* routes are started in turn */
+
+/* files with writes that may have left the contents unchanged */
+ContentCheck *check_list;
+int n_check, check_size;
+
+/* directories that differ from their snapshot */
+WatchFile **settle_list;
+int n_settle, settle_size;
+WatchFile **reopen_list; /* removed files that have not reappeared */
+int n_reopen, reopen_size;
+int n_reopening; /* files in reopen_list that are checked on a timer */
+WatchFile **parent_list;
+int n_parents, parent_size;
+
+/* files checked using stat(2) at an interval */
+int poll_mode;        /* ENTR_POLL */
+int poll_interval_ms; /* ENTR_POLL_INTERVAL */
+int poll_next_ms;     /* grows while no changes are found */
+int poll_armed;
+PollFile *poll_list;
+int n_poll, poll_size;
+FileSystem *fs_list; /* file systems that have been tested */
+int n_fs, fs_size;
+pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+WorkQueue poll_queue;
+
+/* state of the watch list kept between sessions */
+const char *index_path; /* ENTR_INDEX */
+Index watch_index;
+WatchFile **stale_list; /* files changed since the utility was last run */
+int n_stale, stale_size;
+
 static char *shell, *shell_base;
 static char *argv0, *argv0_base;
 
+/* prepared command line */
+char **spawn_argv;
+char **sh_argv;
+int spawn_subst = -1; /* argument replaced by the leading edge */
+char spawn_path[PATH_MAX];
+posix_spawnattr_t spawn_attr;
+posix_spawn_file_actions_t spawn_actions;
+
 /* function pointers */
 
 int (*xstat)(const char *path, struct stat *sb);
@@ -74,17 +348,95 @@ int (*xstat)(const char *path, struct stat *sb);
 
 static void usage(bool);
 static void terminate_utility();
+static int stop_process(pid_t, int *, struct rusage *);
 static void set_restart_signal();
+static void set_restart_timeout();
+static int parse_uint(const char *, const char *);
+static void set_debounce();
+static void set_jobs();
+static void set_poll();
 static void handle_exit(int sig);
+static void signal_exit(void);
 static void proc_exit(int sig);
-static void print_child_status(int status);
-static int process_input(FILE *, WatchFile *[], int);
+static void print_child_status(int status, const struct rusage *, uint64_t, const char *name);
+static void trace_kevent(const struct kevent *);
+static void trace_exit(pid_t, int, const struct rusage *, uint64_t);
+static void trace_summary(void);
+static void *arena_alloc(size_t);
+static WatchFile *new_watch_file(const char *, struct stat *, int);
+static int is_listed(const char *, struct stat *);
+static void add_watch_file(WatchFile *);
+static void *work_loop(void *);
+static void work_start(WorkQueue *, int, void (*)(int, void *), void *);
+static void work_finish(WorkQueue *);
+static void work_fail(WorkQueue *, int, int);
+static void stat_input(int, void *);
+static void register_file(int, void *);
+static void check_content(int, void *);
+static void poll_stat(int, void *);
+static int fingerprint(WatchFile *);
+static void queue_check(WatchFile *);
+static void add_input_line(const char *, size_t);
+static int read_input(int);
+static int process_input(int);
+static void follow_input(int);
 static int set_options(char *[]);
-static int list_dir(char *);
-static void run_utility(char *[]);
-static void watch_file(int, WatchFile *);
-static int compare_dir_contents(WatchFile *);
-static void watch_loop(int, char *[]);
+static int join_path(char *, const char *, const char *);
+static int walk_dir(int, WatchFile *, DIR *);
+static void queue_scan(WatchFile *);
+static int scan_dir(int, WatchFile *);
+static void release_tree(int, WatchFile *);
+static void prune_file(int, WatchFile *);
+static void free_removed(void);
+static int resolve_utility(const char *, char *);
+static void prepare_utility(char *[]);
+static int spawn_utility(pid_t *, const posix_spawn_file_actions_t *);
+static void run_utility(int);
+static void stop_utility(int);
+static void child_exit(int);
+static int open_file(WatchFile *);
+static int add_watch(int, WatchFile *);
+static int register_watch(int, WatchFile *);
+static int watch_file(int, WatchFile *);
+static void watch_failed(WatchFile *, int, int);
+static void unwatch_file(int, WatchFile *);
+static void reopen_file(int, WatchFile *);
+static void reopen_check(int);
+static WatchFile *absent_check(int);
+static void watch_parent(int, WatchFile *);
+static int remote_fs(int);
+static int poll_fs(WatchFile *);
+static int stat_min(const char *, struct stat *);
+static void poll_add(WatchFile *);
+static void poll_remove(WatchFile *);
+static int poll_scan(int);
+static void poll_schedule(int);
+static void load_index(void);
+static void save_index(void);
+static void queue_update(WatchFile *);
+static void update_index(void);
+static void add_path(PathList *, const char *);
+static void add_changed(const char *);
+static int compare_path(const void *, const void *);
+static void sort_paths(PathList *);
+static void clear_paths(PathList *);
+static int write_paths(PathList *);
+static void worker_send(int);
+static void worker_flush(int);
+static void worker_close(int);
+static void load_routes(const char *);
+static void route_changes(int);
+static void route_start(int);
+static void route_reap(Route *);
+static void route_exit(int, Route *);
+static void report_entry(const char *, int, void *);
+static int compare_dir_contents(WatchFile *, int);
+static void settle_dir(int, WatchFile *);
+static int settle_check(int);
+static int debounce(int);
+static void debounce_cancel(int);
+static int read_events(int, const struct timespec *);
+static void watch_loop(int);
 
 /*
  * The Event Notify Test Runner
@@ -96,10 +448,10 @@ main(int argc, char *argv[]) {
 	struct sigaction act;
 	int ttyfd;
 	short argv_index;
-	int n_files;
-	int i;
+	struct pollfd pfd;
 	struct kevent evSet;
 	int open_max;
+	int i;
 
 	/* call usage() if no command is supplied */
 	if (argc < 2)
@@ -109,7 +461,7 @@ main(int argc, char *argv[]) {
 	sigemptyset(&act.sa_mask);
 
 	/* normally a user will exit this utility by do_execting Ctrl-C */
-	act.sa_flags = SA_RESETHAND;
+	act.sa_flags = 0;
 	act.sa_handler = handle_exit;
 	if (sigaction(SIGINT, &act, NULL) != 0)
 		err(1, "Failed to set SIGINT handler");
@@ -119,6 +471,22 @@ main(int argc, char *argv[]) {
 		err(1, "Failed to set SIGHUP handler");
 
 	set_restart_signal();
+	set_restart_timeout();
+	set_debounce();
+	set_poll();
+	if (table_opt) {
+		load_routes(argv[argv_index]);
+		set_jobs();
+	}
+	trace_opt = getenv("EV_TRACE") != NULL;
+	trace_open(getenv("ENTR_TRACE_FD"));
+
+	/* a persistent utility that exits is detected when its input is written */
+	if (worker_opt) {
+		act.sa_handler = SIG_IGN;
+		if (sigaction(SIGPIPE, &act, NULL) != 0)
+			err(1, "Failed to set SIGPIPE handler");
+	}
 
 	/* notification used to combine the one-shot and restart options */
 	act.sa_flags = 0;
@@ -138,6 +506,12 @@ main(int argc, char *argv[]) {
 	open_max = (unsigned) fs_sysctl(INOTIFY_MAX_USER_WATCHES);
 	if (open_max == 0)
 		open_max = 65536;
+	/*
+	 * one mark per file system or one watch per directory; descriptors are
+	 * closed after registration
+	 */
+	if (select_backend() != BACKEND_INOTIFY)
+		open_max = INT_MAX - 1;
 #elif defined(_MACOS_PORT)
 	struct rlimit rl;
 	int mib[2] = { CTL_KERN, KERN_MAXFILESPERPROC };
@@ -161,7 +535,7 @@ main(int argc, char *argv[]) {
 		err(1, "setrlimit cannot set rlim_cur to %u", open_max);
 #endif
 
-	if (getenv("EV_TRACE"))
+	if (trace_opt)
 		fprintf(stderr, "open_max: %d\n", open_max);
 
 	/* prevent interactive utilities from paging output */
@@ -174,7 +548,7 @@ main(int argc, char *argv[]) {
 	shell_base = basename(shell_base);
 
 	/* initialize status filter */
-	if (shell_opt)
+	if (shell_opt || table_opt)
 		argv0 = shell;
 	else
 		argv0 = (argv + argv_index)[0];
@@ -182,15 +556,17 @@ main(int argc, char *argv[]) {
 	if (status_filter_opt)
 		start_log_filter(status_filter_opt);
 
-	/* drop privileges */
-	if (pledge("stdio rpath tty proc exec", NULL) == -1)
+	/*
+	 * drop privileges; the list of changed files is written to a temporary
+	 * file and the index is replaced
+	 */
+	index_path = getenv("ENTR_INDEX");
+	if (pledge((list_opt || index_path) ? "stdio rpath wpath cpath tty proc exec"
+	                                    : "stdio rpath tty proc exec",
+		NULL)
+	    == -1)
 		err(1, "pledge");
 
-	/* sequential scan may depend on a 0 at the end */
-	files = calloc(open_max + 1, sizeof(WatchFile *));
-	if (files == NULL)
-		err(1, "calloc");
-
 	if ((kq = kqueue()) == -1)
 		err(1, "cannot create kqueue");
 
@@ -199,7 +575,27 @@ main(int argc, char *argv[]) {
 		usage(false);
 
 	/* read input and populate watch list, skipping non-regular files */
-	n_files = process_input(stdin, files, open_max);
+	if (follow_opt) {
+		/* keep reading after the tty is moved onto stdin */
+		if ((input_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, STDERR_FILENO + 1)) == -1)
+			err(1, "unable to duplicate stdin");
+		if (fcntl(input_fd, F_SETFL, fcntl(input_fd, F_GETFL) | O_NONBLOCK) == -1)
+			err(1, "fcntl");
+		/* wait for the first paths, then accept what is available */
+		pfd.fd = input_fd;
+		pfd.events = POLLIN;
+		while ((n_input == 0) && (input_fd != -1)) {
+			if ((poll(&pfd, 1, -1) == -1) && (errno != EINTR))
+				err(1, "poll");
+			if (read_input(input_fd) == 0) {
+				close(input_fd);
+				input_fd = -1;
+			}
+		}
+	} else
+		read_input(STDIN_FILENO);
+	max_files = open_max;
+	n_files = process_input(max_files);
 	if (n_files == 0)
 		errx(1, "No regular files to watch");
 	if (n_files == -1)
@@ -208,8 +604,30 @@ main(int argc, char *argv[]) {
 		    " class is %u. Please consult"
 		    " http://eradman.com/entrproject/limits.html",
 		    open_max);
-	for (i = 0; i < n_files; i++)
-		watch_file(kq, files[i]);
+	if (trace_opt)
+		fprintf(stderr, "n_files: %d\n", n_files);
+
+	/* the first run is skipped if nothing changed since the last session */
+	if (index_path != NULL)
+		load_index();
+
+	/* registration may overlap with the first run of the utility */
+	work_start(&register_queue, n_files, register_file, &kq);
+
+	/* the input stream is not available to the utility */
+	if (follow_opt && noninteractive_opt) {
+		ttyfd = open(_PATH_DEVNULL, O_RDONLY);
+		if ((ttyfd == -1) || (dup2(ttyfd, STDIN_FILENO) != 0))
+			err(1, "can't dup2 to stdin");
+		close(ttyfd);
+	}
+
+	/* add paths as they arrive on the input */
+	if (input_fd != -1) {
+		EV_SET(&evSet, input_fd, EVFILT_READ, EV_ADD, NOTE_LOWAT, 1, NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			warnx("failed to register input");
+	}
 
 	if (!noninteractive_opt) {
 		/* Attempt to open a tty so that editors don't complain */
@@ -230,7 +648,21 @@ main(int argc, char *argv[]) {
 			warnx("failed to register stdin");
 	}
 
-	watch_loop(kq, argv + argv_index);
+	/* signals to exit are handled by the watch loop */
+	if (pipe(signal_pipe) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++) {
+		if ((fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC) == -1)
+		    || (fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK) == -1))
+			err(1, "fcntl");
+	}
+	EV_SET(&evSet, signal_pipe[0], EVFILT_READ, EV_ADD, NOTE_LOWAT, 1, NULL);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+		err(1, "failed to register READ event");
+	watching = 1;
+
+	prepare_utility(argv + argv_index);
+	watch_loop(kq);
 	return 1;
 }
 
@@ -239,7 +671,7 @@ main(int argc, char *argv[]) {
 void
 usage(bool summary) {
 	fprintf(stderr, "release: %s\n", RELEASE);
-	fprintf(stderr, "usage: entr [-acdnprsxz] utility [argument [/_] ...] < filenames\n");
+	fprintf(stderr, "usage: entr [-acdfilnpRrstwxz] utility [argument [/_] ...] < filenames\n");
 	if (!summary) {
 		fprintf(stderr, "hint: use -h to display option summary\n");
 		goto end;
@@ -249,10 +681,16 @@ usage(bool summary) {
 	       "    -a  Do not consolidate events\n"
 	       "    -c  Clear screen before execution\n"
 	       "    -d  Track files added or removed from directories\n"
+	       "    -f  Continue reading file names from standard input\n"
+	       "    -i  Ignore writes that leave file contents unchanged\n"
+	       "    -l  Provide the list of changed files to the utility\n"
 	       "    -n  Non-interactive mode\n"
 	       "    -p  Wait for first event\n"
+	       "    -R  Watch directories recursively\n"
 	       "    -r  Run as a background process, use signal to restart\n"
 	       "    -s  Evaluate using a shell\n"
+	       "    -t  Run commands from a table of routes\n"
+	       "    -w  Write changes to a persistent utility\n"
 	       "    -x  Format exit status\n"
 	       "    -z  Exit after the utility completes\n");
 	printf("docs:\n"
@@ -264,19 +702,51 @@ end:
 
 void
 terminate_utility() {
+	struct rusage ru;
 	int status;
+	int i;
 
 	terminating = 1;
 
 	if (child_pid > 0) {
-		killpg(child_pid, restart_signal);
-		waitpid(child_pid, &status, 0);
+		if (stop_process(child_pid, &status, &ru) == 0)
+			trace_exit(child_pid, status, &ru, trace_now() - run_us);
 		child_pid = 0;
 	}
+	for (i = 0; i < n_routes; i++) {
+		if (routes[i].pid > 0) {
+			if (stop_process(routes[i].pid, &status, &ru) == 0)
+				trace_exit(routes[i].pid, status, &ru, trace_now() - routes[i].start_us);
+			routes[i].pid = 0;
+		}
+	}
 
 	terminating = 0;
 }
 
+/*
+ * Signal a process group and wait for the leader to exit, killing it once
+ * ENTR_RESTART_TIMEOUT has passed. Returns -1 if it was already reaped
+ */
+int
+stop_process(pid_t pid, int *status, struct rusage *ru) {
+	struct timespec delay = { 0, 10 * 1000000 };
+	pid_t ret;
+	int ms;
+
+	/* the utility is the leader of a process group only if one was requested */
+	if (killpg(pid, restart_signal) == -1)
+		kill(pid, restart_signal);
+	for (ms = 0; ms < restart_timeout_ms; ms += 10) {
+		if ((ret = wait4(pid, status, WNOHANG, ru)) != 0)
+			return (ret == pid) ? 0 : -1;
+		nanosleep(&delay, NULL);
+	}
+	if (killpg(pid, SIGKILL) == -1)
+		kill(pid, SIGKILL);
+	return (wait4(pid, status, 0, ru) == pid) ? 0 : -1;
+}
+
 void
 set_restart_signal() {
 	const char *sig;
@@ -301,24 +771,145 @@ set_restart_signal() {
 		errx(1, "unrecognized signal: %s <> (HUP, INT, QUIT, TERM, USR1, USR2)", sig);
 }
 
+void
+set_restart_timeout() {
+	const char *timeout;
+
+	if ((timeout = getenv("ENTR_RESTART_TIMEOUT")) == NULL)
+		restart_timeout_ms = RESTART_TIMEOUT;
+	else
+		restart_timeout_ms = parse_uint("ENTR_RESTART_TIMEOUT", timeout);
+}
+
+/*
+ * Read a non-negative number, such as milliseconds, from the environment.
+ * Returns 0 if unset
+ */
+int
+parse_uint(const char *name, const char *value) {
+	char *end;
+	long n;
+
+	if ((value == NULL) || (*value == '\0'))
+		return 0;
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if ((errno != 0) || (*end != '\0') || (n < 0) || (n > INT_MAX))
+		errx(1, "invalid %s: %s", name, value);
+	return (int) n;
+}
+
+void
+set_debounce() {
+	debounce_ms = parse_uint("ENTR_DEBOUNCE", getenv("ENTR_DEBOUNCE"));
+	debounce_max_ms = parse_uint("ENTR_DEBOUNCE_MAX", getenv("ENTR_DEBOUNCE_MAX"));
+	if (debounce_max_ms == 0)
+		debounce_max_ms = (debounce_ms > INT_MAX / 10) ? INT_MAX : debounce_ms * 10;
+	if (debounce_max_ms < debounce_ms)
+		errx(1, "ENTR_DEBOUNCE_MAX may not be less than ENTR_DEBOUNCE");
+}
+
+/*
+ * Routes run at the same time up to ENTR_JOBS, by default one for each
+ * processor
+ */
+void
+set_jobs() {
+	max_jobs = parse_uint("ENTR_JOBS", getenv("ENTR_JOBS"));
+	if (max_jobs > JOBS_MAX)
+		errx(1, "ENTR_JOBS may not be greater than %d", JOBS_MAX);
+	if (max_jobs == 0)
+		max_jobs = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), JOBS_MAX);
+}
+
+/*
+ * Files on a file system that may not report changes made on other hosts are
+ * polled unless ENTR_POLL is set to "all" or "none". The interval may be set
+ * using ENTR_POLL_INTERVAL
+ */
+void
+set_poll() {
+	const char *mode = getenv("ENTR_POLL");
+
+	if ((mode == NULL) || (strcmp(mode, "auto") == 0))
+		poll_mode = POLL_AUTO;
+	else if (strcmp(mode, "all") == 0)
+		poll_mode = POLL_ALL;
+	else if (strcmp(mode, "none") == 0)
+		poll_mode = POLL_NONE;
+	else
+		errx(1, "invalid ENTR_POLL: %s", mode);
+	poll_interval_ms = parse_uint("ENTR_POLL_INTERVAL", getenv("ENTR_POLL_INTERVAL"));
+	if (poll_interval_ms == 0)
+		poll_interval_ms = POLL_INTERVAL;
+	poll_next_ms = poll_interval_ms;
+}
+
 /* Callbacks */
 
+/*
+ * Only record the signal; the utility is stopped by the watch loop, which
+ * reads the pipe. Before the utility is started there is nothing to stop
+ */
 void
 handle_exit(int sig) {
+	struct sigaction act;
+	int saved_errno = errno;
+
+	if (exit_signal == 0)
+		exit_signal = sig;
+	if (watching) {
+		(void) write(signal_pipe[1], "", 1);
+		errno = saved_errno;
+		return;
+	}
+
+	terminating = 1;
+	if (status_filter_opt)
+		end_log_filter();
+	if ((sig == SIGINT || sig == SIGHUP))
+		_exit(0);
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	act.sa_handler = SIG_DFL;
+	sigaction(sig, &act, NULL);
+	raise(sig);
+}
+
+/*
+ * Stop the utility and routes, waiting for each to exit, and exit using the
+ * signal that was received
+ */
+void
+signal_exit(void) {
+	struct sigaction act;
+	int sig = exit_signal;
+
 	if ((!noninteractive_opt) && (termios_set))
 		tcsetattr(STDIN_FILENO, TCSADRAIN, &canonical_tty);
 
 	terminate_utility();
+	trace_summary();
 
+	/* the status process exits when its input is closed */
+	terminating = 1;
 	if (status_filter_opt)
 		end_log_filter();
 
 	if ((sig == SIGINT || sig == SIGHUP))
 		_exit(0);
-	else
-		raise(sig);
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	act.sa_handler = SIG_DFL;
+	sigaction(sig, &act, NULL);
+	raise(sig);
+	_exit(128 + sig);
 }
 
+/*
+ * Detect the exit of the status process. The utility and routes are reaped by
+ * the watch loop
+ */
 void
 proc_exit(int sig) {
 	int status;
@@ -339,386 +930,2389 @@ proc_exit(int sig) {
 		}
 	}
 
-	if (waitpid(child_pid, &status, 0) != -1) {
-		child_status = status;
-
-		if ((!noninteractive_opt) && (termios_set))
-			tcsetattr(STDIN_FILENO, TCSADRAIN, &canonical_tty);
-
-		if ((oneshot_opt == 1) && (terminating == 0)) {
-			if (restart_opt == 0)
-				print_child_status(child_status);
-
-			if (WIFSIGNALED(child_status))
-				_exit(128 + WTERMSIG(child_status));
-			else
-				_exit(WEXITSTATUS(child_status));
-		}
-	}
 	/* restore errno so that the resuming code is unimpacted. */
 	errno = saved_errno;
 }
 
+/*
+ * Report the exit of a run to the status filter as type|code|name followed by
+ * the wall, user and system time in milliseconds, the maximum resident set in
+ * kilobytes and the voluntary and involuntary context switches. Resource
+ * usage is zero if the utility could not be started
+ */
 void
-print_child_status(int status) {
+print_child_status(int status, const struct rusage *ru, uint64_t wall_us, const char *name) {
+	const struct rusage none = { 0 };
 	int len;
 	char buf[2048];
 
 	if (status_filter_opt) {
-		if (WIFSIGNALED(status))
-			len = snprintf(buf, sizeof(buf), "signal|%d|%s\n", WTERMSIG(status), argv0_base);
-		else
-			len = snprintf(buf, sizeof(buf), "exit|%d|%s\n", WEXITSTATUS(status), argv0_base);
+		if (ru == NULL)
+			ru = &none;
+		len = snprintf(buf, sizeof(buf), "%s|%d|%s|%llu|%llu|%llu|%ld|%ld|%ld\n",
+		    WIFSIGNALED(status) ? "signal" : "exit",
+		    WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status), name,
+		    (unsigned long long) wall_us / 1000,
+		    (unsigned long long) TIMEVAL_US(ru->ru_utime) / 1000,
+		    (unsigned long long) TIMEVAL_US(ru->ru_stime) / 1000, MAXRSS_KB(ru), ru->ru_nvcsw,
+		    ru->ru_nivcsw);
 		write_log_filter(buf, len);
 	}
 }
 
 /*
- * Read lines from a file stream (normally STDIN).  Returns the number of
- * regular files to be watched or -1 if max_files is exceeded.
+ * Structured trace
+ *   trace_kevent  : record the receipt of an event
+ *   trace_exit    : record the exit of the utility
+ *   trace_summary : report counters and histograms
  */
-int
-process_input(FILE *file, WatchFile *files[], int max_files) {
-	char buf[PATH_MAX + 1];
-	char *p, *path, *parent_path;
-	int n_files = 0;
-	struct stat sb;
-	int i, matches;
-	size_t len;
+void
+trace_kevent(const struct kevent *kev) {
+	char flags[128], path[PATH_MAX + 16];
+	WatchFile *file;
+	size_t len = 0;
+	int i;
+	const struct {
+		unsigned int note;
+		const char *name;
+	} note[] = { { NOTE_DELETE, "delete" }, { NOTE_WRITE, "write" }, { NOTE_RENAME, "rename" },
+		{ NOTE_TRUNCATE, "truncate" }, { NOTE_ATTRIB, "attrib" } };
+
+	if (kev->filter == EVFILT_TIMER) {
+		trace_write("event", "\"filter\":\"timer\",\"ident\":%d", (int) kev->ident);
+		return;
+	}
+	if (kev->filter == EVFILT_PROC) {
+		trace_write("event", "\"filter\":\"proc\",\"ident\":%d", (int) kev->ident);
+		return;
+	}
+	if (kev->filter != EVFILT_VNODE) {
+		trace_write("event", "\"filter\":\"%s\",\"ident\":%d",
+		    (kev->filter == EVFILT_WRITE) ? "write" : "read", (int) kev->ident);
+		return;
+	}
+	file = (WatchFile *) kev->udata;
+	flags[len++] = '[';
+	for (i = 0; i < (int) (sizeof(note) / sizeof(note[0])); i++) {
+		if ((note[i].note != 0) && (kev->fflags & note[i].note))
+			len += snprintf(flags + len, sizeof(flags) - len, "%s\"%s\"",
+			    (len > 1) ? "," : "", note[i].name);
+	}
+	flags[len++] = ']';
+	flags[len] = '\0';
+	trace_write("event", "\"filter\":\"vnode\",\"flags\":%s,\"dir\":%s,\"path\":%s", flags,
+	    file->is_dir ? "true" : "false", trace_string(path, sizeof(path), file->fn));
+}
 
-	while (fgets(buf, sizeof(buf), file) != NULL) {
-		if ((p = strchr(buf, '\n')) != NULL)
-			*p = '\0';
-		if (buf[0] == '\0')
-			continue;
-		path = &buf[0];
+void
+trace_exit(pid_t pid, int status, const struct rusage *ru, uint64_t wall_us) {
+	if (trace_fd == -1)
+		return;
+	trace_hist_add(&trace_stats.runtime, wall_us);
+	trace_write("exit",
+	    "\"pid\":%d,\"%s\":%d,\"runtime_us\":%llu,\"user_us\":%llu,\"sys_us\":%llu,"
+	    "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld",
+	    pid, WIFSIGNALED(status) ? "signal" : "status",
+	    WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+	    (unsigned long long) wall_us, (unsigned long long) TIMEVAL_US(ru->ru_utime),
+	    (unsigned long long) TIMEVAL_US(ru->ru_stime), MAXRSS_KB(ru), ru->ru_nvcsw,
+	    ru->ru_nivcsw);
+}
 
-		len = strlen(path);
-		if ((len + 1) > PATH_MAX) {
-			path[100] = '\0';
-			errx(1, "path too long: %s..", path);
-		}
+void
+trace_summary(void) {
+	char latency[1024], runtime[1024], scan[1024];
 
-		if (xstat(path, &sb) == -1) {
-			warnx("unable to stat '%s'", path);
-			continue;
-		}
+	if (trace_fd == -1)
+		return;
+	trace_hist_format(latency, sizeof(latency), &trace_stats.latency);
+	trace_hist_format(runtime, sizeof(runtime), &trace_stats.runtime);
+	trace_hist_format(scan, sizeof(scan), &trace_stats.scan);
+	trace_write("stats",
+	    "\"files\":%d,\"kevent_calls\":%lu,\"batches\":%lu,\"events\":%lu,"
+	    "\"max_batch\":%d,\"runs\":%lu,\"deferred\":%lu,\"unchanged\":%lu,"
+	    "\"collated\":%lu,\"latency_max_us\":%llu,\"latency_us\":%s,\"runtime_us\":%s,"
+	    "\"polled\":%d,\"scan_us\":%s",
+	    n_files, batch_stats.calls, batch_stats.batches, batch_stats.events,
+	    batch_stats.max_batch, trace_stats.runs, trace_stats.deferred, trace_stats.unchanged,
+	    trace_stats.collated, (unsigned long long) trace_stats.latency.max, latency, runtime,
+	    n_poll, scan);
+}
 
-		if ((S_ISREG(sb.st_mode) | S_ISLNK(sb.st_mode)) != 0) {
-			files[n_files] = malloc(sizeof(WatchFile));
-			if (files[n_files] == NULL)
-				err(1, "malloc");
-			memcpy(files[n_files]->fn, path, len + 1);
-			files[n_files]->is_dir = 0;
-			files[n_files]->is_symlink = (S_ISLNK(sb.st_mode) != 0) ? 1 : 0;
-			files[n_files]->file_count = 0;
-			files[n_files]->mode = sb.st_mode;
-			files[n_files]->ino = sb.st_ino;
-			n_files++;
+/*
+ * Bump allocator for file records and path names, which live until exit.
+ * Small allocations are carved out of large chunks to avoid per-malloc
+ * overhead
+ */
+void *
+arena_alloc(size_t size) {
+	static char *chunk;
+	static size_t avail;
+	void *p;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (size > ARENA_CHUNK / 4) {
+		if ((p = malloc(size)) == NULL)
+			err(1, "malloc");
+		return p;
+	}
+	if (size > avail) {
+		if ((chunk = malloc(ARENA_CHUNK)) == NULL)
+			err(1, "malloc");
+		avail = ARENA_CHUNK;
+	}
+	p = chunk;
+	chunk += size;
+	avail -= size;
+	return p;
+}
 
-			/* also watch the directory if it's not already in the list */
-			if (dirwatch_opt > 0) {
-				if ((parent_path = dirname(path)) == 0)
-					err(1, "dirname '%s' failed", path);
-				for (matches = 0, i = 0; i < n_files; i++) {
-					if ((files[i]->is_dir == 1) && (strcmp(files[i]->fn, parent_path) == 0))
-						matches++;
-				}
-				if (matches == 0) {
-					if (stat(parent_path, &sb) == -1)
-						warnx("unable to stat '%s'", parent_path);
-					path = parent_path;
-				}
-			}
-		}
-		if (S_ISDIR(sb.st_mode) != 0) {
-			files[n_files] = malloc(sizeof(WatchFile));
-			if (files[n_files] == NULL)
-				err(1, "malloc");
-			memcpy(files[n_files]->fn, path, len + 1);
-			files[n_files]->is_dir = 1;
-			files[n_files]->is_symlink = 0;
-			files[n_files]->file_count = list_dir(path);
-			files[n_files]->mode = sb.st_mode;
-			files[n_files]->ino = sb.st_ino;
-			n_files++;
-		}
-		if (n_files + 1 > max_files)
-			return -1;
+/*
+ * Allocate a file record and a copy of its path name. Records that may be
+ * removed while running are allocated individually so that they can be freed
+ */
+WatchFile *
+new_watch_file(const char *path, struct stat *sb, int allocated) {
+	WatchFile *file;
+	size_t len = strlen(path);
+
+	if (allocated) {
+		if ((file = malloc(sizeof(WatchFile) + len + 1)) == NULL)
+			err(1, "malloc");
+		file->fn = (char *) (file + 1);
+	} else {
+		file = arena_alloc(sizeof(WatchFile));
+		file->fn = arena_alloc(len + 1);
 	}
-	return n_files;
+	memcpy(file->fn, path, len + 1);
+	file->fd = -1;
+	file->is_dir = S_ISDIR(sb->st_mode) != 0;
+	file->is_symlink = S_ISLNK(sb->st_mode) != 0;
+	file->settle = 0;
+	file->snapshot = NULL;
+	file->mode = sb->st_mode;
+	file->ino = sb->st_ino;
+	file->dev = sb->st_dev;
+	file->is_tree = 0;
+	file->is_removed = 0;
+	file->is_allocated = allocated;
+	file->is_queued = 0;
+	file->scan = 0;
+	file->parent = NULL;
+	file->child = NULL;
+	file->next = NULL;
+	file->reopen = 0;
+	file->is_absent = 0;
+	file->is_parent = 0;
+	file->poll = -1;
+	file->fan_dir = NULL;
+	file->has_digest = 0;
+	file->size = sb->st_size;
+	file->mtime = sb->st_mtim;
+	file->index_entry = -1;
+	file->is_stale = 0;
+	return file;
 }
 
+/*
+ * Test if a path, or another name for the same inode, is already listed
+ */
 int
-list_dir(char *dir) {
-	struct dirent *dp;
-	DIR *dfd = opendir(dir);
-	int count = 0;
-
-	if (dfd == NULL)
-		errx(1, "unable to open directory: '%s'", dir);
-	while ((dp = readdir(dfd)) != NULL)
-		if ((dirwatch_opt == 2) || (dp->d_name[0] != '.'))
-			count++;
-	closedir(dfd);
-	return count;
+is_listed(const char *path, struct stat *sb) {
+	WatchFile key;
+
+	key.fn = (char *) path;
+	key.ino = sb->st_ino;
+	key.dev = sb->st_dev;
+	return (table_find(&path_table, &key) != NULL) || (table_find(&inode_table, &key) != NULL);
 }
 
 /*
- * Evaluate command line arguments and return an offset to the command to
- * execute.
+ * Append to the global file list, which grows to fit the input
  */
-int
-set_options(char *argv[]) {
-	int ch;
-	int argc;
+void
+add_watch_file(WatchFile *file) {
+	static size_t files_len;
+	WatchFile **p;
+
+	if ((size_t) n_files + 1 >= files_len) {
+		files_len = files_len ? files_len * 2 : 256;
+		if ((p = realloc(files, files_len * sizeof(WatchFile *))) == NULL)
+			err(1, "realloc");
+		files = p;
+	}
+	files[n_files++] = file;
+	files[n_files] = NULL;
+	table_insert(&path_table, file);
+	table_insert(&inode_table, file);
+}
 
-	if (argv[1] && strcmp(argv[1], "-h") == 0)
-		usage(true);
+/*
+ * Hand out batches of work to a pool of threads so that stat(2) and watch
+ * registration on slow or cold file systems do not proceed one file at a
+ * time. Small jobs are run by the calling thread
+ */
+void *
+work_loop(void *arg) {
+	WorkQueue *q = arg;
+	int i, end;
 
-	/* read arguments until we reach a command */
-	for (argc = 1; argv[argc] != 0 && argv[argc][0] == '-'; argc++)
-		;
-	while ((ch = getopt(argc, argv, "acdnprsxz")) != -1) {
-		switch (ch) {
-		case 'a':
-			aggressive_opt = 1;
-			break;
-		case 'c':
-			clear_opt = clear_opt ? 2 : 1;
-			break;
-		case 'd':
-			dirwatch_opt = dirwatch_opt ? 2 : 1;
-			break;
-		case 'n':
-			noninteractive_opt = 1;
-			break;
-		case 'p':
-			postpone_opt = 1;
-			break;
-		case 'r':
-			restart_opt = 1;
-			break;
-		case 's':
-			shell_opt = 1;
-			break;
-		case 'x':
-			status_filter_opt = status_filter_opt ? 2 : 1;
-			break;
-		case 'z':
-			oneshot_opt = 1;
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next;
+		q->next += WORK_BATCH;
+		pthread_mutex_unlock(&q->lock);
+		if (i >= q->n)
 			break;
-		default:
-			usage(false);
-		}
+		for (end = MIN(i + WORK_BATCH, q->n); i < end; i++)
+			q->fn(i, q->arg);
 	}
-	if (argv[optind] == 0)
-		usage(false);
+	return NULL;
+}
 
-	if (status_filter_opt && restart_opt)
-		errx(1, "-r and -x may not be combined");
+void
+work_start(WorkQueue *q, int n, void (*fn)(int, void *), void *arg) {
+	long ncpu;
+	int t;
+
+	q->n_threads = 0;
+	q->next = 0;
+	q->n = n;
+	q->fn = fn;
+	q->arg = arg;
+	q->failed = -1;
+	if (pthread_mutex_init(&q->lock, NULL) != 0)
+		errx(1, "pthread_mutex_init");
+
+	if (n < WORK_BATCH * 2) {
+		work_loop(q);
+		return;
+	}
 
-	if ((shell_opt == 1) && (argv[optind + 1] != 0))
-		errx(1, "-s requires commands to be formatted as a single argument");
-	return optind;
+	/* file system calls may block on I/O; use a few threads even if few cores */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	q->n_threads = MIN(MIN(MAX(ncpu, 4), WORK_THREADS_MAX), n / WORK_BATCH);
+	for (t = 0; t < q->n_threads; t++) {
+		if (pthread_create(&q->thread[t], NULL, work_loop, q) != 0)
+			errx(1, "pthread_create");
+	}
+}
+
+void
+work_finish(WorkQueue *q) {
+	int t;
+
+	for (t = 0; t < q->n_threads; t++)
+		pthread_join(q->thread[t], NULL);
+	pthread_mutex_destroy(&q->lock);
+	q->n_threads = 0;
 }
 
 /*
- * Execute the program supplied on the command line. If restart was set
- * then send the child process SIGTERM and restart it.
+ * Threads may not exit the process, so the first failure is recorded for the
+ * main thread to report once the queue is finished. No further work is handed
+ * out
  */
 void
-run_utility(char *argv[]) {
-	int pid;
-	int i, m;
-	int ret, status;
-	struct timespec delay = { 0, 1000000 };
-	char **new_argv;
-	char *p, *arg_buf, *src;
-	int argc;
-	size_t len, rem;
+work_fail(WorkQueue *q, int i, int status) {
+	int error = errno;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->failed == -1) {
+		q->failed = i;
+		q->status = status;
+		q->error = error;
+	}
+	q->next = q->n;
+	pthread_mutex_unlock(&q->lock);
+}
 
-	if (restart_opt == 1)
-		terminate_utility();
+/*
+ * Work functions
+ *   stat_input   : record the mode and inode for an input path
+ *   register_file: open a file and add it to the kernel queue
+ *   check_content: compare a file to its fingerprint
+ *   poll_stat    : compare a polled file to the attributes last seen
+ */
 
-	arg_buf = malloc(rem = ARG_MAX);
-	if (arg_buf == NULL)
-		err(1, "malloc");
+void
+stat_input(int i, void *arg) {
+	InputPath *input = arg;
+	struct stat sb;
 
-	if (shell_opt == 1) {
-		/* run argv[1] with a shell using the leading edge as $0 */
+	if (xstat(input[i].path, &sb) == -1) {
+		input[i].error = errno;
+		return;
+	}
+	input[i].error = 0;
+	input[i].mode = sb.st_mode;
+	input[i].ino = sb.st_ino;
+	input[i].dev = sb.st_dev;
+	input[i].size = sb.st_size;
+	input[i].mtime = sb.st_mtim;
+}
+
+void
+register_file(int i, void *arg) {
+	int status;
+
+	if ((status = watch_file(*(int *) arg, files[i])) != 0) {
+		work_fail(&register_queue, i, status);
+		return;
+	}
+	if (identical_opt)
+		fingerprint(files[i]);
+}
+
+void
+check_content(int i, void *arg) {
+	ContentCheck *check = arg;
+
+	check[i].changed = fingerprint(check[i].file);
+}
+
+void
+poll_stat(int i, void *arg) {
+	PollFile *p = &((PollFile *) arg)[i];
+	struct stat sb;
+
+	p->fflags = 0;
+	if ((stat_min(p->file->fn, &sb) == -1) || (sb.st_ino != p->ino)) {
+		p->fflags = NOTE_DELETE;
+		return;
+	}
+	if ((sb.st_size != p->size) || (sb.st_mtim.tv_sec != p->mtime.tv_sec)
+	    || (sb.st_mtim.tv_nsec != p->mtime.tv_nsec))
+		p->fflags |= NOTE_WRITE;
+	if (sb.st_mode != p->mode)
+		p->fflags |= NOTE_ATTRIB;
+	p->mode = sb.st_mode;
+	p->size = sb.st_size;
+	p->mtime = sb.st_mtim;
+}
+
+/*
+ * Update the fingerprint of a regular file. Returns 1 if the contents differ
+ * from the previous fingerprint or cannot be read. The digest is only
+ * recomputed if the size or modification time has changed
+ */
+int
+fingerprint(WatchFile *file) {
+	unsigned char buf[FINGERPRINT_BUF];
+	struct stat sb;
+	ContentHash hash;
+	uint64_t digest;
+	ssize_t n;
+	size_t len;
+	int fd;
+
+	if (stat(file->fn, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		file->has_digest = 0;
+		return 1;
+	}
+	if (file->has_digest && (sb.st_size == file->size)
+	    && (sb.st_mtim.tv_sec == file->mtime.tv_sec)
+	    && (sb.st_mtim.tv_nsec == file->mtime.tv_nsec))
+		return 0;
+
+	if ((fd = open(file->fn, O_RDONLY | O_CLOEXEC)) == -1) {
+		file->has_digest = 0;
+		return 1;
+	}
+	/* a file may be truncated while it is read, which is a change */
+	hash_init(&hash);
+	for (len = 0; (n = read(fd, buf, sizeof(buf))) > 0; len += n)
+		hash_update(&hash, buf, n);
+	close(fd);
+	if ((n == -1) || (len != (size_t) sb.st_size)) {
+		file->has_digest = 0;
+		return 1;
+	}
+	digest = hash_final(&hash);
+
+	if (file->has_digest && (digest == file->digest) && (sb.st_size == file->size)) {
+		file->mtime = sb.st_mtim;
+		return 0;
+	}
+	file->has_digest = 1;
+	file->size = sb.st_size;
+	file->mtime = sb.st_mtim;
+	file->digest = digest;
+	return 1;
+}
+
+void
+queue_check(WatchFile *file) {
+	ContentCheck *p;
+
+	if (file->is_queued)
+		return;
+	if (n_check == check_size) {
+		check_size = check_size ? check_size * 2 : 32;
+		if ((p = realloc(check_list, check_size * sizeof(ContentCheck))) == NULL)
+			err(1, "realloc");
+		check_list = p;
+	}
+	check_list[n_check++].file = file;
+	file->is_queued = 1;
+}
+
+/*
+ * Append a line to the list of paths waiting to be processed
+ */
+void
+add_input_line(const char *line, size_t len) {
+	char buf[101];
+
+	if (len == 0)
+		return;
+	if ((len + 1) > PATH_MAX) {
+		memcpy(buf, line, 100);
+		buf[100] = '\0';
+		errx(1, "path too long: %s..", buf);
+	}
+
+	if (n_input == input_size) {
+		input_size = input_size ? input_size * 2 : 256;
+		if ((input = realloc(input, input_size * sizeof(InputPath))) == NULL)
+			err(1, "realloc");
+	}
+	while (text_len + len + 1 > text_size) {
+		text_size = text_size ? text_size * 2 : ARENA_CHUNK;
+		if ((text = realloc(text, text_size)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(text + text_len, line, len);
+	text[text_len + len] = '\0';
+	input[n_input++].off = text_len;
+	text_len += len + 1;
+}
+
+/*
+ * Read lines from a file descriptor (normally STDIN). A partial line is
+ * retained until the next call. Returns 0 at end of file or 1 if the
+ * descriptor is nonblocking and no more input is available
+ */
+int
+read_input(int fd) {
+	static char line[PATH_MAX + 1];
+	static size_t line_len;
+	char buf[8192];
+	char *p, *nl;
+	ssize_t n;
+	size_t len;
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 1;
+			err(1, "read");
+		}
+		if (n == 0) {
+			add_input_line(line, line_len);
+			line_len = 0;
+			return 0;
+		}
+		for (p = buf; p < buf + n; p = nl + 1) {
+			if ((nl = memchr(p, '\n', buf + n - p)) == NULL)
+				nl = buf + n;
+			len = nl - p;
+			if (line_len + len > PATH_MAX)
+				len = PATH_MAX - line_len; /* rejected when the line is added */
+			memcpy(line + line_len, p, len);
+			line_len += len;
+			if (nl < buf + n) {
+				add_input_line(line, line_len);
+				line_len = 0;
+			}
+		}
+	}
+}
+
+/*
+ * Process lines read from the input.  Returns the number of regular files to
+ * be watched or -1 if max_files is exceeded. Paths that are repeated or refer
+ * to an inode that is already listed are skipped.  stat(2) is called in
+ * parallel while preserving the order of the input
+ */
+int
+process_input(int max_files) {
+	char buf[PATH_MAX + 1];
+	char *path, *parent_path;
+	int i;
+	struct stat sb;
+	WatchFile *wf;
+	WatchFile key;
+	DIR *dfd;
+
+	if (path_table.hash == NULL) {
+		table_init(&path_table, hash_path, equal_path);
+		table_init(&inode_table, hash_inode, equal_inode);
+	}
+
+	for (i = 0; i < n_input; i++)
+		input[i].path = text + input[i].off;
+	work_start(&register_queue, n_input, stat_input, input);
+	work_finish(&register_queue);
+
+	for (i = 0; i < n_input; i++) {
+		/* dirname(3) may modify its argument */
+		path = strcpy(buf, input[i].path);
+
+		if (input[i].error != 0) {
+			warnx("unable to stat '%s'", path);
+			continue;
+		}
+		memset(&sb, 0, sizeof(sb));
+		sb.st_mode = input[i].mode;
+		sb.st_ino = input[i].ino;
+		sb.st_dev = input[i].dev;
+		sb.st_size = input[i].size;
+		sb.st_mtim = input[i].mtime;
+
+		if ((S_ISREG(sb.st_mode) | S_ISLNK(sb.st_mode)) != 0) {
+			if (!is_listed(path, &sb))
+				add_watch_file(new_watch_file(path, &sb, 0));
+
+			/* also watch the directory if it's not already in the list */
+			if (dirwatch_opt > 0) {
+				if ((parent_path = dirname(path)) == 0)
+					err(1, "dirname '%s' failed", path);
+				key.fn = parent_path;
+				if (table_find(&path_table, &key) == NULL) {
+					if (stat(parent_path, &sb) == -1)
+						warnx("unable to stat '%s'", parent_path);
+					path = parent_path;
+				}
+			}
+		}
+		if ((S_ISDIR(sb.st_mode) != 0) && !is_listed(path, &sb)) {
+			wf = new_watch_file(path, &sb, 0);
+			if (recursive_opt) {
+				wf->is_tree = 1;
+				add_watch_file(wf);
+				if ((dfd = opendir(path)) == NULL)
+					errx(1, "unable to open directory: '%s'", path);
+				walk_dir(-1, wf, dfd);
+				closedir(dfd);
+			} else {
+				if ((wf->snapshot = snapshot_take(path, dirwatch_opt == 2)) == NULL)
+					errx(1, "unable to open directory: '%s'", path);
+				add_watch_file(wf);
+			}
+		}
+		if (n_files + 1 > max_files) {
+			n_input = 0;
+			text_len = 0;
+			return -1;
+		}
+	}
+	n_input = 0;
+	text_len = 0;
+	return n_files;
+}
+
+/*
+ * Add paths that arrive on the input after startup. The watch set is
+ * extended, but the utility is not run
+ */
+void
+follow_input(int kq) {
+	struct kevent evSet;
+	int i, prev_n_files = n_files;
+
+	if (read_input(input_fd) == 0) {
+		EV_SET(&evSet, input_fd, EVFILT_READ, EV_DELETE, NOTE_LOWAT, 0, NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			err(1, "failed to remove READ event");
+		close(input_fd);
+		input_fd = -1;
+	}
+	if (process_input(max_files) == -1) {
+		warnx("Too many files listed; ignoring further input");
+		/* entries added before the limit was reached are not watched */
+		for (i = prev_n_files; i < n_files; i++) {
+			table_remove(&path_table, files[i]);
+			table_remove(&inode_table, files[i]);
+			if (files[i]->snapshot != NULL)
+				snapshot_free(files[i]->snapshot);
+			if (files[i]->is_allocated)
+				free(files[i]);
+		}
+		n_files = prev_n_files;
+		files[n_files] = NULL;
+		return;
+	}
+	/* a listed file may already be gone; do not block or exit while waiting for it */
+	for (i = prev_n_files; i < n_files; i++) {
+		reopen_file(kq, files[i]);
+		if (identical_opt)
+			fingerprint(files[i]);
+	}
+	if (trace_opt && (n_files > prev_n_files))
+		fprintf(stderr, "n_files: %d\n", n_files);
+}
+
+/*
+ * Recursive mode
+ *   join_path   : format the path of a directory entry
+ *   walk_dir    : add entries that are not listed, descending into
+ *                 subdirectories. Returns the number of entries added
+ *   queue_scan  : arrange for a directory to be scanned once per pass
+ *   scan_dir    : prune entries that no longer exist and add new ones.
+ *                 Returns the number of changes
+ *   release_tree: stop watching a file and everything below it
+ *   prune_file  : remove a file from its directory and release it
+ *   free_removed: drop released files from the file list
+ */
+
+int
+join_path(char *buf, const char *dir, const char *name) {
+	size_t len = strlen(dir);
+	int n;
+
+	if ((len > 0) && (dir[len - 1] == '/'))
+		n = snprintf(buf, PATH_MAX, "%s%s", dir, name);
+	else
+		n = snprintf(buf, PATH_MAX, "%s/%s", dir, name);
+	return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+int
+walk_dir(int kq, WatchFile *dir, DIR *dfd) {
+	char path[PATH_MAX];
+	struct dirent *dp;
+	struct stat sb;
+	WatchFile *file;
+	DIR *subdir;
+	int flag = (xstat == lstat) ? AT_SYMLINK_NOFOLLOW : 0;
+	int added = 0;
+
+	while ((dp = readdir(dfd)) != NULL) {
+		if ((strcmp(dp->d_name, ".") == 0) || (strcmp(dp->d_name, "..") == 0))
+			continue;
+		if ((recursive_opt < 2) && (dp->d_name[0] == '.'))
+			continue;
+		if (join_path(path, dir->fn, dp->d_name) == -1) {
+			warnx("path too long: %s", dp->d_name);
+			continue;
+		}
+		if (fstatat(dirfd(dfd), dp->d_name, &sb, flag) == -1)
+			continue; /* removed since it was listed */
+		if ((S_ISREG(sb.st_mode) | S_ISLNK(sb.st_mode) | S_ISDIR(sb.st_mode)) == 0)
+			continue;
+		if (is_listed(path, &sb))
+			continue;
+		if (n_files + 1 > max_files) {
+			warnx("Too many files listed; ignoring '%s'", path);
+			return added;
+		}
+
+		/* entries found after startup are registered immediately */
+		file = new_watch_file(path, &sb, kq != -1);
+		file->parent = dir;
+		file->next = dir->child;
+		dir->child = file;
+		file->scan = scan_generation;
+		add_watch_file(file);
+		if (kq != -1) {
+			if ((open_file(file) == -1) || (register_watch(kq, file) == -1)) {
+				prune_file(kq, file);
+				continue;
+			}
+			if (identical_opt && S_ISREG(sb.st_mode))
+				fingerprint(file);
+			if (track_changed && !file->is_dir)
+				add_changed(file->fn);
+		}
+		added++;
+
+		if (file->is_dir) {
+			file->is_tree = 1;
+			if ((subdir = opendir(path)) == NULL)
+				continue;
+			added += walk_dir(kq, file, subdir);
+			closedir(subdir);
+		}
+	}
+	return added;
+}
+
+void
+queue_scan(WatchFile *dir) {
+	WatchFile **p;
+
+	if (dir->is_queued)
+		return;
+	if (n_scan == scan_size) {
+		scan_size = scan_size ? scan_size * 2 : 32;
+		if ((p = realloc(scan_list, scan_size * sizeof(WatchFile *))) == NULL)
+			err(1, "realloc");
+		scan_list = p;
+	}
+	scan_list[n_scan++] = dir;
+	dir->is_queued = 1;
+}
+
+int
+scan_dir(int kq, WatchFile *dir) {
+	char path[PATH_MAX];
+	struct dirent *dp;
+	WatchFile *file, **link;
+	WatchFile key;
+	DIR *dfd;
+	int changes = 0;
+
+	if ((dfd = opendir(dir->fn)) == NULL)
+		return 0; /* pruned when its own event is processed */
+
+	/* mark entries that are still present */
+	scan_generation++;
+	while ((dp = readdir(dfd)) != NULL) {
+		if (join_path(path, dir->fn, dp->d_name) == -1)
+			continue;
+		key.fn = path;
+		if (((file = table_find(&path_table, &key)) != NULL) && (file->parent == dir))
+			file->scan = scan_generation;
+	}
+	for (link = &dir->child; (file = *link) != NULL;) {
+		if (file->scan == scan_generation) {
+			link = &file->next;
+			continue;
+		}
+		*link = file->next;
+		release_tree(kq, file);
+		changes++;
+	}
+
+	rewinddir(dfd);
+	changes += walk_dir(kq, dir, dfd);
+	closedir(dfd);
+
+	if (trace_opt && (changes > 0))
+		fprintf(stderr, "n_files: %d\n", n_files - n_removed);
+	return changes;
+}
+
+void
+release_tree(int kq, WatchFile *file) {
+	WatchFile *child, *next;
+	WatchFile **p;
+	int i;
+
+	for (child = file->child; child != NULL; child = next) {
+		next = child->next;
+		release_tree(kq, child);
+	}
+	file->child = NULL;
+	if (file->fd != -1)
+		unwatch_file(kq, file);
+	if (track_changed && !file->is_dir)
+		add_changed(file->fn);
+	table_remove(&path_table, file);
+	table_remove(&inode_table, file);
+	file->is_removed = 1;
+
+	/* a file waiting to be opened again is no longer expected */
+	if ((file->reopen > 0) || file->is_absent) {
+		for (i = 0; i < n_reopen; i++) {
+			if (reopen_list[i] == file) {
+				memmove(reopen_list + i, reopen_list + i + 1,
+				    (n_reopen - i - 1) * sizeof(WatchFile *));
+				n_reopen--;
+				break;
+			}
+		}
+		if (file->reopen > 0)
+			n_reopening--;
+		file->reopen = 0;
+		file->is_absent = 0;
+	}
+
+	if (n_removed == removed_size) {
+		removed_size = removed_size ? removed_size * 2 : 32;
+		if ((p = realloc(removed, removed_size * sizeof(WatchFile *))) == NULL)
+			err(1, "realloc");
+		removed = p;
+	}
+	removed[n_removed++] = file;
+}
+
+void
+prune_file(int kq, WatchFile *file) {
+	WatchFile **link;
+
+	for (link = &file->parent->child; *link != NULL; link = &(*link)->next) {
+		if (*link == file) {
+			*link = file->next;
+			break;
+		}
+	}
+	release_tree(kq, file);
+}
+
+void
+free_removed(void) {
+	int i, j;
+
+	for (i = 0, j = 0; i < n_files; i++) {
+		if (!files[i]->is_removed)
+			files[j++] = files[i];
+	}
+	n_files = j;
+	files[n_files] = NULL;
+	if ((leading_edge != NULL) && leading_edge->is_removed)
+		leading_edge = files[0];
+
+	for (i = 0; i < n_removed; i++) {
+		if (removed[i]->is_allocated)
+			free(removed[i]);
+	}
+	n_removed = 0;
+}
+
+/*
+ * Evaluate command line arguments and return an offset to the command to
+ * execute.
+ */
+int
+set_options(char *argv[]) {
+	int ch;
+	int argc;
+
+	if (argv[1] && strcmp(argv[1], "-h") == 0)
+		usage(true);
+
+	/* read arguments until we reach a command */
+	for (argc = 1; argv[argc] != 0 && argv[argc][0] == '-'; argc++)
+		;
+	while ((ch = getopt(argc, argv, "acdfilnpRrstwxz")) != -1) {
+		switch (ch) {
+		case 'a':
+			aggressive_opt = 1;
+			break;
+		case 'c':
+			clear_opt = clear_opt ? 2 : 1;
+			break;
+		case 'd':
+			dirwatch_opt = dirwatch_opt ? 2 : 1;
+			break;
+		case 'f':
+			follow_opt = 1;
+			break;
+		case 'i':
+			identical_opt = 1;
+			break;
+		case 'l':
+			list_opt = 1;
+			break;
+		case 'n':
+			noninteractive_opt = 1;
+			break;
+		case 'p':
+			postpone_opt = 1;
+			break;
+		case 'R':
+			recursive_opt = recursive_opt ? 2 : 1;
+			break;
+		case 'r':
+			restart_opt = 1;
+			break;
+		case 's':
+			shell_opt = 1;
+			break;
+		case 't':
+			table_opt = 1;
+			break;
+		case 'w':
+			worker_opt = 1;
+			break;
+		case 'x':
+			status_filter_opt = status_filter_opt ? 2 : 1;
+			break;
+		case 'z':
+			oneshot_opt = 1;
+			break;
+		default:
+			usage(false);
+		}
+	}
+	if (argv[optind] == 0)
+		usage(false);
+
+	if (status_filter_opt && restart_opt)
+		errx(1, "-r and -x may not be combined");
+	if (worker_opt && restart_opt)
+		errx(1, "-r and -w may not be combined");
+	if (worker_opt && list_opt)
+		errx(1, "-l and -w may not be combined");
+	if (table_opt && (restart_opt || shell_opt || worker_opt || oneshot_opt))
+		errx(1, "-t may not be combined with -r, -s, -w or -z");
+	track_changed = list_opt || table_opt || worker_opt;
+
+	if ((shell_opt == 1) && (argv[optind + 1] != 0))
+		errx(1, "-s requires commands to be formatted as a single argument");
+	if (table_opt && (argv[optind + 1] != 0))
+		errx(1, "-t requires the path to a table of routes as a single argument");
+	return optind;
+}
+
+/*
+ * Launch the utility
+ *   resolve_utility : search PATH for an executable. Returns 0 if found
+ *   prepare_utility : build the argument vector and spawn attributes once
+ *   spawn_utility   : start the utility using posix_spawn(3), which does not
+ *                     copy the address space of a large watch list
+ *   run_utility     : execute the program supplied on the command line. If
+ *                     the child process is running it is started again once
+ *                     it exits, and if restart was set it is stopped
+ */
+int
+resolve_utility(const char *name, char *path) {
+	const char *dirs, *end;
+	struct stat sb;
+	size_t len;
+
+	if (strchr(name, '/') != NULL)
+		return -1;
+	if ((dirs = getenv("PATH")) == NULL)
+		dirs = _PATH_DEFPATH;
+	for (; *dirs != '\0'; dirs = end + (*end == ':')) {
+		if ((end = strchr(dirs, ':')) == NULL)
+			end = dirs + strlen(dirs);
+		len = end - dirs;
+		if (len == 0)
+			len = snprintf(path, PATH_MAX, "%s", name);
+		else
+			len = snprintf(path, PATH_MAX, "%.*s/%s", (int) len, dirs, name);
+		if (len >= PATH_MAX)
+			continue;
+		if ((stat(path, &sb) == 0) && S_ISREG(sb.st_mode) && (access(path, X_OK) == 0))
+			return 0;
+	}
+	return -1;
+}
+
+void
+prepare_utility(char *argv[]) {
+	sigset_t mask;
+	short flags;
+	int argc, i;
+
+	if ((shell_opt == 1) || table_opt) {
+		/* run argv[1] with a shell using the leading edge as $0; routes replace argv[1] */
 		argc = 4;
-		new_argv = calloc(argc + 1, sizeof(char *));
-		if (new_argv == NULL)
+		if ((spawn_argv = calloc(argc + 1, sizeof(char *))) == NULL)
 			err(1, "calloc");
-		new_argv[0] = shell;
-		new_argv[1] = "-c";
-		new_argv[2] = argv[0];
-		new_argv[3] = leading_edge->fn;
+		spawn_argv[0] = shell;
+		spawn_argv[1] = "-c";
+		spawn_argv[2] = argv[0];
+		spawn_subst = 3;
 	} else {
-		/* clone argv on each invocation to allow for substitution rules */
 		for (argc = 0; argv[argc]; argc++)
 			;
-		new_argv = calloc(argc + 1, sizeof(char *));
-		if (new_argv == NULL)
+		if ((spawn_argv = calloc(argc + 1, sizeof(char *))) == NULL)
 			err(1, "calloc");
-		new_argv[0] = "/bin/false";
-		for (m = 0, i = 0, p = arg_buf; i < argc; i++) {
-			new_argv[i] = p;
-			if ((m < 1) && (strcmp(argv[i], "/_")) == 0) {
-				src = leading_edge->fn;
-				m++;
-			} else
-				src = argv[i];
-
-			len = strlen(src);
-			if (len + 1 > rem)
-				errx(1, "argument list too long");
-
-			memcpy(p, src, len + 1);
-			p += len + 1;
-			rem -= len + 1;
-		}
-	}
-
-	pid = fork();
-	if (pid == -1)
-		err(1, "can't fork");
-
-	if (pid == 0) {
-		/* 2J - erase the entire display
-		 * 3J - clear scrollback buffer
-		 * H  - set cursor position to the default
-		 */
-		if (clear_opt == 1)
-			printf("\033[2J\033[H");
-		if (clear_opt == 2)
-			printf("\033[2J\033[3J\033[H");
-		fflush(stdout);
-
-		/* Set process group so subprocess can be signaled */
-		if (restart_opt == 1) {
-			setpgid(0, getpid());
-			close(STDIN_FILENO);
-			open(_PATH_DEVNULL, O_RDONLY);
-		}
-		/* wait up to 1 seconds for each file to become available */
-		for (i = 0; i < 10; i++) {
-			ret = execvp(new_argv[0], new_argv);
-			if (errno == ETXTBSY)
+		for (i = 0; i < argc; i++) {
+			if ((spawn_subst == -1) && (strcmp(argv[i], "/_") == 0))
+				spawn_subst = i;
+			spawn_argv[i] = argv[i];
+		}
+	}
+	/* files without an interpreter are run using the shell, as execvp(3) does */
+	if ((sh_argv = calloc(argc + 2, sizeof(char *))) == NULL)
+		err(1, "calloc");
+	sh_argv[0] = _PATH_BSHELL;
+
+	if (resolve_utility(spawn_argv[0], spawn_path) == -1)
+		spawn_path[0] = '\0';
+
+	/* the utility starts with the signal mask that entr started with */
+	sigprocmask(SIG_SETMASK, NULL, &mask);
+	posix_spawnattr_init(&spawn_attr);
+	posix_spawnattr_setsigmask(&spawn_attr, &mask);
+	posix_spawn_file_actions_init(&spawn_actions);
+	flags = POSIX_SPAWN_SETSIGMASK;
+	if ((restart_opt == 1) || worker_opt || table_opt) {
+		/* set process group so subprocess can be signaled */
+		posix_spawnattr_setpgroup(&spawn_attr, 0);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	if (restart_opt == 1)
+		posix_spawn_file_actions_addopen(&spawn_actions, STDIN_FILENO, _PATH_DEVNULL, O_RDONLY, 0);
+	if (worker_opt) {
+		/* SIGPIPE is ignored by entr only */
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGPIPE);
+		posix_spawnattr_setsigdefault(&spawn_attr, &mask);
+		flags |= POSIX_SPAWN_SETSIGDEF;
+	}
+	posix_spawnattr_setflags(&spawn_attr, flags);
+}
+
+/*
+ * Returns 0 or an error number
+ */
+int
+spawn_utility(pid_t *pid, const posix_spawn_file_actions_t *actions) {
+	struct timespec delay = { 0, 1000000 };
+	int i, ret;
+
+	/* wait up to 1 seconds for each file to become available */
+	for (i = 0; i < 10; i++) {
+		if (spawn_path[0] != '\0')
+			ret = posix_spawn(pid, spawn_path, actions, &spawn_attr, spawn_argv, environ);
+		else
+			ret = posix_spawnp(pid, spawn_argv[0], actions, &spawn_attr, spawn_argv, environ);
+		/* the executable may have moved since it was found */
+		if ((ret == ENOENT) && (spawn_path[0] != '\0')) {
+			spawn_path[0] = '\0';
+			i--;
+		} else if (ret == ETXTBSY)
+			nanosleep(&delay, NULL);
+		else
+			break;
+	}
+	if (ret == ENOEXEC) {
+		sh_argv[1] = (spawn_path[0] != '\0') ? spawn_path : spawn_argv[0];
+		for (i = 1; spawn_argv[i]; i++)
+			sh_argv[i + 1] = spawn_argv[i];
+		ret = posix_spawn(pid, _PATH_BSHELL, actions, &spawn_attr, sh_argv, environ);
+	}
+	return ret;
+}
+
+void
+run_utility(int kq) {
+	struct kevent evSet;
+	pid_t pid;
+	int ret;
+	int list_fd = -1;
+	int fds[2] = { -1, -1 };
+	char fd_buf[16], path[PATH_MAX + 16];
+	posix_spawn_file_actions_t worker_actions;
+	uint64_t spawn_us = 0;
+
+	if ((child_pid > 0) && (restart_opt == 1)) {
+		stop_utility(kq);
+		return;
+	}
+	if (child_pid > 0) {
+		if ((run_pending == 0) && (trace_fd != -1))
+			trace_write("coalesce", "\"decision\":\"pending\"");
+		run_pending = 1;
+		return;
+	}
+	run_pending = 0;
+
+	if (spawn_subst != -1)
+		spawn_argv[spawn_subst] = leading_edge->fn;
+
+	/* the list of changed files is inherited */
+	if (list_opt && ((list_fd = write_paths(&changed)) != -1)) {
+		snprintf(fd_buf, sizeof(fd_buf), "%d", list_fd);
+		setenv("ENTR_CHANGED_FD", fd_buf, 1);
+	}
+
+	/* a persistent utility reads messages from a pipe on standard input */
+	if (worker_opt) {
+		if (pipe(fds) == -1)
+			err(1, "pipe");
+		if ((fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1)
+		    || (fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1)
+		    || (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1))
+			err(1, "fcntl");
+		posix_spawn_file_actions_init(&worker_actions);
+		posix_spawn_file_actions_adddup2(&worker_actions, fds[0], STDIN_FILENO);
+	}
+
+	/* 2J - erase the entire display
+	 * 3J - clear scrollback buffer
+	 * H  - set cursor position to the default
+	 */
+	if (clear_opt == 1)
+		printf("\033[2J\033[H");
+	if (clear_opt == 2)
+		printf("\033[2J\033[3J\033[H");
+	fflush(stdout);
+
+	run_us = trace_now();
+	ret = spawn_utility(&pid, worker_opt ? &worker_actions : &spawn_actions);
+	if (trace_fd != -1)
+		spawn_us = trace_now() - run_us;
+	child_pid = (ret == 0) ? pid : 0;
+
+	if (list_fd != -1) {
+		unsetenv("ENTR_CHANGED_FD");
+		close(list_fd);
+	}
+	if (list_opt)
+		clear_paths(&changed);
+	if (worker_opt) {
+		posix_spawn_file_actions_destroy(&worker_actions);
+		close(fds[0]);
+		if (ret == 0)
+			worker_fd = fds[1];
+		else
+			close(fds[1]);
+	}
+
+	if (ret != 0) {
+		errno = ret;
+		warn("exec %s", spawn_argv[0]);
+		child_status = W_EXITCODE(1, 0);
+		if (oneshot_opt == 1) {
+			if ((!noninteractive_opt) && (termios_set))
+				tcsetattr(STDIN_FILENO, TCSADRAIN, &canonical_tty);
+			trace_summary();
+			exit(1);
+		}
+		print_child_status(child_status, NULL, 0, argv0_base);
+		return;
+	}
+
+	trace_stats.runs++;
+	if (trace_fd != -1) {
+		/* the first run is not started by a change */
+		if ((change_us != 0) && (stop_us != 0)) {
+			trace_hist_add(&trace_stats.latency, run_us - change_us);
+			trace_write("fork",
+			    "\"pid\":%d,\"latency_us\":%llu,\"stop_us\":%llu,\"spawn_us\":%llu", pid,
+			    (unsigned long long) (run_us - change_us),
+			    (unsigned long long) (run_us - stop_us), (unsigned long long) spawn_us);
+		} else if (change_us != 0) {
+			trace_hist_add(&trace_stats.latency, run_us - change_us);
+			trace_write("fork", "\"pid\":%d,\"latency_us\":%llu,\"spawn_us\":%llu", pid,
+			    (unsigned long long) (run_us - change_us), (unsigned long long) spawn_us);
+		} else
+			trace_write("fork", "\"pid\":%d,\"spawn_us\":%llu", pid,
+			    (unsigned long long) spawn_us);
+		trace_write("exec", "\"pid\":%d,\"path\":%s", pid,
+		    trace_string(path, sizeof(path),
+			(spawn_path[0] != '\0') ? spawn_path : spawn_argv[0]));
+		change_us = 0;
+		stop_us = 0;
+	}
+
+	/* the utility may have exited already */
+	EV_SET(&evSet, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1) {
+		if (errno != ESRCH)
+			err(1, "failed to register PROC event");
+		child_exited = 1;
+	}
+}
+
+/*
+ * Supervise the utility without blocking the watch loop
+ *   stop_utility : signal the utility to exit; it is killed if it is still
+ *                  running when RESTART_TIMER expires
+ *   child_exit   : reap the utility and start it again if a run is pending
+ */
+void
+stop_utility(int kq) {
+	struct kevent evSet;
+
+	run_pending = 1;
+	if (stopping)
+		return;
+	stopping = 1;
+	if (trace_fd != -1)
+		stop_us = trace_now();
+	killpg(child_pid, restart_signal);
+	EV_SET(&evSet, RESTART_TIMER, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, restart_timeout_ms, NULL);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+		err(1, "failed to register TIMER event");
+}
+
+void
+child_exit(int kq) {
+	struct kevent evSet;
+	int status;
+
+	if (wait4(child_pid, &status, 0, &child_usage) == child_pid) {
+		child_status = status;
+		child_wall_us = trace_now() - run_us;
+		trace_exit(child_pid, status, &child_usage, child_wall_us);
+	}
+	child_pid = 0;
+
+	if (stopping) {
+		stopping = 0;
+		/* fails if the timer has already fired */
+		EV_SET(&evSet, RESTART_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		kevent(kq, &evSet, 1, NULL, 0, NULL);
+	} else {
+		/* the status of a persistent utility is reported when it is started again */
+		if (worker_opt == 0)
+			print_child_status(child_status, &child_usage, child_wall_us, argv0_base);
+		if (oneshot_opt == 1) {
+			if ((!noninteractive_opt) && (termios_set))
+				tcsetattr(STDIN_FILENO, TCSADRAIN, &canonical_tty);
+			trace_summary();
+			if (WIFSIGNALED(child_status))
+				exit(128 + WTERMSIG(child_status));
+			exit(WEXITSTATUS(child_status));
+		}
+	}
+	if (run_pending)
+		run_utility(kq);
+}
+
+/*
+ * Open a file so that it can be watched
+ */
+int
+open_file(WatchFile *file) {
+#if defined(O_EVTONLY)
+	file->fd = open(file->fn, O_RDONLY | O_CLOEXEC | O_EVTONLY | O_SYMLINK);
+#elif defined(O_PATH)
+	file->fd = open(file->fn, O_RDONLY | O_CLOEXEC | O_PATH | O_NOFOLLOW);
+#else
+	file->fd = open(file->fn, O_RDONLY | O_CLOEXEC);
+#endif
+	return file->fd;
+}
+
+/*
+ * Add an open file to the kernel queue, or to the list of polled files. Returns
+ * -1 if the file could not be registered
+ *   add_watch      : may be called from the pool of threads
+ *   register_watch : exits if the queue is out of resources
+ */
+int
+add_watch(int kq, WatchFile *file) {
+	struct kevent evSet;
+	int saved_errno;
+
+	if (poll_fs(file)) {
+		close(file->fd);
+		file->fd = POLL_FD;
+		poll_add(file);
+		return 0;
+	}
+	EV_SET(&evSet, file->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_ALL, 0, file);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1) {
+		saved_errno = errno;
+		if (file->fd != -1)
+			close(file->fd);
+		file->fd = -1;
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+int
+register_watch(int kq, WatchFile *file) {
+	if (add_watch(kq, file) == 0)
+		return 0;
+	if (errno == ENOSPC)
+		watch_failed(file, WATCH_REGISTER, ENOSPC);
+	return -1;
+}
+
+/*
+ * Wait for file to become accessible and register a kevent to watch it.
+ * Returns WATCH_OPEN or WATCH_REGISTER with errno set if this fails
+ */
+int
+watch_file(int kq, WatchFile *file) {
+	int i = 0;
+	struct timespec delay = { 0, 100 * 1000000 };
+
+	/* wait up to 1 second for file to become available */
+	for (;;) {
+		if (open_file(file) == -1) {
+			if (i < 10)
 				nanosleep(&delay, NULL);
 			else
+				return WATCH_OPEN;
+		} else
+			break;
+		i++;
+	}
+
+	if (add_watch(kq, file) == -1)
+		return WATCH_REGISTER;
+	return 0;
+}
+
+/*
+ * Report a file that could not be watched and exit. Only called from the main
+ * thread
+ */
+void
+watch_failed(WatchFile *file, int status, int error) {
+	errno = error;
+	if (status == WATCH_OPEN)
+		warn("cannot open '%s'", file->fn);
+	else if (error == ENOSPC)
+		warnx("Unable to allocate memory for kernel queue."
+		    " Please consult"
+		    " http://eradman.com/entrproject/limits.html");
+	else
+		warn("failed to register VNODE event");
+	terminate_utility();
+	exit(1);
+}
+
+/*
+ * Remove a file from the kernel queue
+ */
+void
+unwatch_file(int kq, WatchFile *file) {
+	struct kevent evSet;
+
+	if (file->fd == POLL_FD) {
+		poll_remove(file);
+		file->fd = -1;
+		return;
+	}
+	EV_SET(&evSet, file->fd, EVFILT_VNODE, EV_DELETE, NOTE_ALL, 0, file);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+		err(1, "failed to remove VNODE event");
+#if !defined(_LINUX_PORT)
+	/* free file descriptor no longer monitored by kqueue */
+	if ((file->fd != -1) && (close(file->fd) == -1))
+		err(1, "unable to close file");
+#endif
+	file->fd = -1;
+}
+
+/*
+ * Files that are removed or renamed
+ *   reopen_file  : watch a file again, or check for it on a timer if it has
+ *                  not reappeared yet
+ *   reopen_check : open files that are waiting on the timer. A file that does
+ *                  not reappear within REOPEN_CHECKS is considered absent
+ *   absent_check : open absent files after an enclosing directory changes.
+ *                  Returns the first file that reappeared, or NULL
+ *   watch_parent : watch the nearest existing directory of an absent file
+ */
+void
+reopen_file(int kq, WatchFile *file) {
+	struct kevent evSet;
+	WatchFile **p;
+
+	if ((open_file(file) != -1) && (register_watch(kq, file) == 0))
+		return;
+	if (n_reopen == reopen_size) {
+		reopen_size = reopen_size ? reopen_size * 2 : 8;
+		if ((p = realloc(reopen_list, reopen_size * sizeof(WatchFile *))) == NULL)
+			err(1, "realloc");
+		reopen_list = p;
+	}
+	reopen_list[n_reopen++] = file;
+	file->reopen = REOPEN_CHECKS;
+	if (n_reopening++ == 0) {
+		EV_SET(&evSet, REOPEN_TIMER, EVFILT_TIMER, EV_ADD, 0, REOPEN_INTERVAL, NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			err(1, "failed to register TIMER event");
+	}
+}
+
+void
+reopen_check(int kq) {
+	struct kevent evSet;
+	char path[PATH_MAX + 16];
+	WatchFile *file;
+	int i, j;
+
+	for (i = 0, j = 0; i < n_reopen; i++) {
+		file = reopen_list[i];
+		if (file->reopen > 0) {
+			if ((open_file(file) != -1) && (register_watch(kq, file) == 0)) {
+				file->reopen = 0;
+				n_reopening--;
+				continue;
+			}
+			if (--file->reopen == 0) {
+				file->is_absent = 1;
+				n_reopening--;
+				if (trace_fd != -1)
+					trace_write("absent", "\"path\":%s",
+					    trace_string(path, sizeof(path), file->fn));
+				watch_parent(kq, file);
+			}
+		}
+		reopen_list[j++] = file;
+	}
+	n_reopen = j;
+	if (n_reopening == 0) {
+		EV_SET(&evSet, REOPEN_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			err(1, "failed to remove TIMER event");
+	}
+}
+
+WatchFile *
+absent_check(int kq) {
+	WatchFile *file, *first = NULL;
+	int i, j;
+
+	/* directories are chosen again for files that remain absent */
+	for (i = 0; i < n_parents; i++) {
+		if (parent_list[i]->fd != -1)
+			unwatch_file(kq, parent_list[i]);
+	}
+	for (i = 0, j = 0; i < n_reopen; i++) {
+		file = reopen_list[i];
+		if (file->is_absent && (open_file(file) != -1) && (register_watch(kq, file) == 0)) {
+			file->is_absent = 0;
+			if (identical_opt && (S_ISREG(file->mode) != 0))
+				queue_check(file);
+			else {
+				if (first == NULL)
+					first = file;
+				if (track_changed)
+					add_changed(file->fn);
+			}
+			continue;
+		}
+		if (file->is_absent)
+			watch_parent(kq, file);
+		reopen_list[j++] = file;
+	}
+	n_reopen = j;
+	return first;
+}
+
+void
+watch_parent(int kq, WatchFile *file) {
+	char buf[PATH_MAX], path[PATH_MAX];
+	struct stat sb;
+	WatchFile key, *dir, **p;
+	int i, found;
+
+	/* dirname(3) may modify its argument */
+	snprintf(path, sizeof(path), "%s", file->fn);
+	do {
+		memcpy(buf, path, sizeof(buf));
+		snprintf(path, sizeof(path), "%s", dirname(buf));
+		found = (stat(path, &sb) == 0) && S_ISDIR(sb.st_mode);
+	} while (!found && (strcmp(path, "/") != 0) && (strcmp(path, ".") != 0));
+
+	/* the root or working directory cannot be read */
+	if (!found)
+		return;
+
+	/* events for directories already under watch also check absent files */
+	key.fn = path;
+	if (((dir = table_find(&path_table, &key)) != NULL) && dir->is_dir && (dir->fd != -1))
+		return;
+	for (i = 0; i < n_parents; i++) {
+		if (strcmp(parent_list[i]->fn, path) == 0)
+			break;
+	}
+	if (i == n_parents) {
+		if (n_parents == parent_size) {
+			parent_size = parent_size ? parent_size * 2 : 8;
+			if ((p = realloc(parent_list, parent_size * sizeof(WatchFile *))) == NULL)
+				err(1, "realloc");
+			parent_list = p;
+		}
+		parent_list[n_parents++] = new_watch_file(path, &sb, 1);
+		parent_list[i]->is_parent = 1;
+	}
+	if ((parent_list[i]->fd == -1) && (open_file(parent_list[i]) != -1))
+		register_watch(kq, parent_list[i]);
+}
+
+/*
+ * Files that are polled
+ *   remote_fs     : test if a file system may not report all changes
+ *   poll_fs       : test if a file is polled, which is decided once for each
+ *                   file system unless ENTR_POLL is set
+ *   stat_min      : stat(2) requesting only the attributes that are compared
+ *   poll_add      : record the attributes of a file to compare
+ *   poll_remove   : stop polling a file
+ *   poll_scan     : check each polled file and append an event for each one
+ *                   that changed. Returns the new number of events
+ *   poll_schedule : start the timer for the next scan
+ */
+int
+remote_fs(int fd) {
+	struct statfs sfs;
+	size_t i;
+#if defined(_LINUX_PORT)
+	/* fuse includes virtiofs and sshfs; afs is OpenAFS and kAFS */
+	const uint32_t types[] = { NFS_SUPER_MAGIC, SMB_SUPER_MAGIC, CIFS_SUPER_MAGIC,
+		SMB2_SUPER_MAGIC, FUSE_SUPER_MAGIC, V9FS_MAGIC, CEPH_SUPER_MAGIC, AFS_SUPER_MAGIC,
+		AFS_FS_MAGIC, CODA_SUPER_MAGIC };
+
+	if (fstatfs(fd, &sfs) == -1)
+		return 0;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if ((uint32_t) sfs.f_type == types[i])
+			return 1;
+	}
+#else
+	const char *types[] = { "nfs", "smbfs", "fuse", "osxfuse", "macfuse", "afpfs", "webdav",
+		"9p", "virtiofs" };
+
+	if (fstatfs(fd, &sfs) == -1)
+		return 0;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (strncmp(sfs.f_fstypename, types[i], strlen(types[i])) == 0)
+			return 1;
+	}
+#endif
+	return 0;
+}
+
+int
+poll_fs(WatchFile *file) {
+	FileSystem *p;
+	int i, polled;
+
+	if (poll_mode != POLL_AUTO)
+		return poll_mode == POLL_ALL;
+
+	/* files may be registered from more than one thread */
+	pthread_mutex_lock(&poll_lock);
+	for (i = 0; i < n_fs; i++) {
+		if (fs_list[i].dev == file->dev)
+			break;
+	}
+	if (i == n_fs) {
+		if (n_fs == fs_size) {
+			fs_size = fs_size ? fs_size * 2 : 8;
+			if ((p = realloc(fs_list, fs_size * sizeof(FileSystem))) == NULL)
+				err(1, "realloc");
+			fs_list = p;
+		}
+		fs_list[i].dev = file->dev;
+		fs_list[i].polled = remote_fs(file->fd);
+		n_fs++;
+		if (trace_opt && fs_list[i].polled)
+			fprintf(stderr, "poll: %s\n", file->fn);
+	}
+	polled = fs_list[i].polled;
+	pthread_mutex_unlock(&poll_lock);
+	return polled;
+}
+
+/*
+ * Network file systems are spared from fetching attributes that are not used
+ */
+int
+stat_min(const char *path, struct stat *sb) {
+#if defined(_LINUX_PORT) && defined(STATX_BASIC_STATS)
+	struct statx stx;
+
+	if (statx(AT_FDCWD, path, (xstat == lstat) ? AT_SYMLINK_NOFOLLOW : 0,
+		STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME, &stx)
+	    == -1)
+		return -1;
+	sb->st_mode = stx.stx_mode;
+	sb->st_ino = stx.stx_ino;
+	sb->st_size = stx.stx_size;
+	sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	return 0;
+#else
+	return xstat(path, sb);
+#endif
+}
+
+void
+poll_add(WatchFile *file) {
+	struct stat sb;
+	PollFile *p;
+
+	memset(&sb, 0, sizeof(sb));
+	stat_min(file->fn, &sb);
+	pthread_mutex_lock(&poll_lock);
+	if (n_poll == poll_size) {
+		poll_size = poll_size ? poll_size * 2 : 32;
+		if ((p = realloc(poll_list, poll_size * sizeof(PollFile))) == NULL)
+			err(1, "realloc");
+		poll_list = p;
+	}
+	p = &poll_list[n_poll];
+	p->file = file;
+	p->ino = sb.st_ino;
+	p->mode = sb.st_mode;
+	p->size = sb.st_size;
+	p->mtime = sb.st_mtim;
+	p->fflags = 0;
+	file->poll = n_poll++;
+	pthread_mutex_unlock(&poll_lock);
+}
+
+void
+poll_remove(WatchFile *file) {
+	pthread_mutex_lock(&poll_lock);
+	poll_list[file->poll] = poll_list[--n_poll];
+	poll_list[file->poll].file->poll = file->poll;
+	file->poll = -1;
+	pthread_mutex_unlock(&poll_lock);
+}
+
+/*
+ * The interval is reset by a change and grows while none are found, but is
+ * kept well above the time taken by a scan so that a file server is not kept
+ * busy
+ */
+int
+poll_scan(int nev) {
+	struct kevent *p;
+	uint64_t start_us, scan_us;
+	int i, changed = 0;
+
+	poll_armed = 0;
+	start_us = trace_now();
+	work_start(&poll_queue, n_poll, poll_stat, poll_list);
+	work_finish(&poll_queue);
+	scan_us = trace_now() - start_us;
+
+	for (i = 0; i < n_poll; i++) {
+		if (poll_list[i].fflags == 0)
+			continue;
+		if (nev == ev_size) {
+			ev_size *= 2;
+			if ((p = realloc(evList, ev_size * sizeof(struct kevent))) == NULL)
+				err(1, "realloc");
+			evList = p;
+		}
+		EV_SET(&evList[nev], 0, EVFILT_VNODE, 0, poll_list[i].fflags, 0, poll_list[i].file);
+		nev++;
+		changed++;
+	}
+
+	if (changed > 0)
+		poll_next_ms = poll_interval_ms;
+	else if (poll_next_ms < poll_interval_ms * POLL_BACKOFF)
+		poll_next_ms = MIN(poll_next_ms * 2, poll_interval_ms * POLL_BACKOFF);
+	poll_next_ms = MAX(poll_next_ms, (int) MIN(scan_us * POLL_LOAD / 1000, INT_MAX));
+
+	trace_hist_add(&trace_stats.scan, scan_us);
+	if (trace_fd != -1)
+		trace_write("scan", "\"files\":%d,\"changed\":%d,\"scan_us\":%llu,\"next_ms\":%d",
+		    n_poll, changed, (unsigned long long) scan_us, poll_next_ms);
+	if (trace_opt)
+		fprintf(stderr, "poll: %d files in %llu us, %d changed, next in %d ms\n", n_poll,
+		    (unsigned long long) scan_us, changed, poll_next_ms);
+	return nev;
+}
+
+void
+poll_schedule(int kq) {
+	struct kevent evSet;
+
+	if ((n_poll == 0) || poll_armed)
+		return;
+	EV_SET(&evSet, POLL_TIMER, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, poll_next_ms, NULL);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+		err(1, "failed to register TIMER event");
+	poll_armed = 1;
+}
+
+/*
+ * Persistent index of the watch list
+ *   load_index   : compare the watch list to the index kept by the previous
+ *                  session. The first run is skipped if no file has changed
+ *   save_index   : replace the index once files have been fingerprinted
+ *   queue_update : note a file to record in the index when the utility is run
+ *   update_index : record the state of files changed since the last run
+ */
+void
+load_index(void) {
+	Index prev;
+	const struct index_entry *e;
+	WatchFile *file;
+	int i, changed = 0;
+
+	if ((index_open(&prev, index_path, 0) == -1) || (prev.header->count != (uint32_t) n_files))
+		changed = n_files;
+	for (i = 0; i < n_files && changed < n_files; i++) {
+		file = files[i];
+		e = &prev.entry[i];
+		if (strcmp(index_name(&prev, i), file->fn) != 0) {
+			changed = n_files;
+			break;
+		}
+		if (((e->flags & INDEX_MISSING) == 0) && (e->ino == (uint64_t) file->ino)
+		    && (e->size == (uint64_t) file->size) && (e->mtime_sec == file->mtime.tv_sec)
+		    && (e->mtime_nsec == file->mtime.tv_nsec)) {
+			/* not read again unless the file is written */
+			if (e->flags & INDEX_DIGEST) {
+				file->has_digest = 1;
+				file->digest = e->digest;
+			}
+			continue;
+		}
+		/* a file that was written may have the same contents */
+		if (identical_opt && (e->flags & INDEX_DIGEST) && (S_ISREG(file->mode) != 0)) {
+			file->has_digest = 1;
+			file->size = e->size;
+			file->mtime.tv_sec = e->mtime_sec;
+			file->mtime.tv_nsec = e->mtime_nsec;
+			file->digest = e->digest;
+			if (fingerprint(file) == 0)
+				continue;
+		}
+		changed++;
+	}
+	index_close(&prev);
+
+	if (trace_fd != -1)
+		trace_write("index", "\"files\":%d,\"changed\":%d", n_files, changed);
+	if (changed == 0)
+		postpone_opt = 1;
+}
+
+void
+save_index(void) {
+	int i;
+
+	if ((index_write(index_path, files, n_files) == -1)
+	    || (index_open(&watch_index, index_path, 1) == -1)) {
+		warn("unable to write index '%s'", index_path);
+		index_path = NULL;
+		return;
+	}
+	for (i = 0; i < n_files; i++)
+		files[i]->index_entry = i;
+}
+
+void
+queue_update(WatchFile *file) {
+	WatchFile **p;
+
+	if (file->is_stale)
+		return;
+	if (n_stale == stale_size) {
+		stale_size = stale_size ? stale_size * 2 : 32;
+		if ((p = realloc(stale_list, stale_size * sizeof(WatchFile *))) == NULL)
+			err(1, "realloc");
+		stale_list = p;
+	}
+	stale_list[n_stale++] = file;
+	file->is_stale = 1;
+}
+
+void
+update_index(void) {
+	struct stat sb;
+	int i;
+
+	for (i = 0; i < n_stale; i++) {
+		stale_list[i]->is_stale = 0;
+		if (xstat(stale_list[i]->fn, &sb) == -1)
+			index_update(&watch_index, stale_list[i]->index_entry, NULL, stale_list[i]);
+		else
+			index_update(&watch_index, stale_list[i]->index_entry, &sb, stale_list[i]);
+	}
+	n_stale = 0;
+}
+
+/*
+ * Lists of changed paths
+ *   add_path    : record a path, which may be repeated
+ *   add_changed : record a path changed since the utility was last run
+ *   compare_path: sort order used to remove repeated paths
+ *   sort_paths  : sort a list and remove repeated paths
+ *   clear_paths : empty a list
+ *   write_paths : write a list to an unlinked temporary file. The list is
+ *                 cleared by the caller once the utility has started, since
+ *                 a path may be passed as an argument. Returns the
+ *                 descriptor positioned at the start, or -1
+ */
+
+void
+add_path(PathList *list, const char *path) {
+	char **p;
+
+	if (list->n == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		if ((p = realloc(list->path, list->size * sizeof(char *))) == NULL)
+			err(1, "realloc");
+		list->path = p;
+	}
+	if ((list->path[list->n++] = strdup(path)) == NULL)
+		err(1, "strdup");
+}
+
+void
+add_changed(const char *path) {
+	add_path(&changed, path);
+}
+
+int
+compare_path(const void *a, const void *b) {
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+void
+sort_paths(PathList *list) {
+	int i, j;
+
+	qsort(list->path, list->n, sizeof(char *), compare_path);
+	for (i = 0, j = 0; i < list->n; i++) {
+		if ((j > 0) && (strcmp(list->path[i], list->path[j - 1]) == 0))
+			free(list->path[i]);
+		else
+			list->path[j++] = list->path[i];
+	}
+	list->n = j;
+}
+
+void
+clear_paths(PathList *list) {
+	int i;
+
+	for (i = 0; i < list->n; i++)
+		free(list->path[i]);
+	list->n = 0;
+}
+
+int
+write_paths(PathList *list) {
+	char template[PATH_MAX];
+	const char *tmpdir;
+	FILE *fp = NULL;
+	int i, fd;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+		tmpdir = _PATH_TMP;
+	snprintf(template, sizeof(template), "%s/entr.XXXXXXXXXX", tmpdir);
+	if ((fd = mkstemp(template)) != -1) {
+		unlink(template);
+		fp = fdopen(dup(fd), "w");
+	}
+	if (fp == NULL) {
+		warn("unable to create list of changed files");
+		if (fd != -1)
+			close(fd);
+		fd = -1;
+	}
+
+	sort_paths(list);
+	for (i = 0; (i < list->n) && (fp != NULL); i++)
+		fprintf(fp, "%s\n", list->path[i]);
+
+	if (fp != NULL) {
+		if (fclose(fp) != 0) {
+			warn("unable to write list of changed files");
+			close(fd);
+			return -1;
+		}
+		lseek(fd, 0, SEEK_SET);
+	}
+	return fd;
+}
+
+/*
+ * Persistent utility
+ *   worker_send : start the utility if it is not running and write the paths
+ *                 changed as one message. Changes are held while an earlier
+ *                 message has not been read and are sent together
+ *   worker_flush: write as much of the current message as the pipe accepts
+ *   worker_close: release the pipe to a utility that has exited
+ */
+
+void
+worker_send(int kq) {
+	uint64_t now_us;
+	size_t len;
+	char *p;
+	int i;
+
+	if (child_pid == 0) {
+		if (worker_fd != -1) {
+			print_child_status(child_status, &child_usage, child_wall_us, argv0_base);
+			worker_close(kq);
+		}
+		run_utility(kq);
+		if (worker_fd == -1)
+			return;
+	}
+	if (worker_off < worker_len) {
+		worker_held = 1;
+		return;
+	}
+	worker_held = 0;
+
+	sort_paths(&changed);
+	for (i = 0, len = 48; i < changed.n; i++)
+		len += strlen(changed.path[i]) + 1;
+	if (len > worker_size) {
+		if ((p = realloc(worker_buf, len)) == NULL)
+			err(1, "realloc");
+		worker_buf = p;
+		worker_size = len;
+	}
+	worker_len = snprintf(worker_buf, worker_size, "%lu %d\n", ++worker_seq, changed.n);
+	for (i = 0; i < changed.n; i++) {
+		len = strlen(changed.path[i]);
+		memcpy(worker_buf + worker_len, changed.path[i], len);
+		worker_len += len;
+		worker_buf[worker_len++] = '\n';
+	}
+	worker_off = 0;
+	if (trace_fd != -1) {
+		now_us = trace_now();
+		if (change_us != 0)
+			trace_hist_add(&trace_stats.latency, now_us - change_us);
+		trace_write("send", "\"seq\":%lu,\"paths\":%d,\"bytes\":%lu,\"latency_us\":%llu",
+		    worker_seq, changed.n, (unsigned long) worker_len,
+		    (unsigned long long) (change_us ? now_us - change_us : 0));
+		change_us = 0;
+	}
+	clear_paths(&changed);
+	worker_flush(kq);
+}
+
+void
+worker_flush(int kq) {
+	struct kevent evSet;
+	ssize_t n;
+
+	while (worker_off < worker_len) {
+		if ((n = write(worker_fd, worker_buf + worker_off, worker_len - worker_off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			/* the utility exited; it is started again by the next change */
+			if (errno != EAGAIN)
+				worker_off = worker_len = 0;
+			break;
+		}
+		worker_off += n;
+	}
+
+	/* resume when the utility has read part of the message */
+	if ((worker_off < worker_len) != worker_polling) {
+		worker_polling = !worker_polling;
+		EV_SET(&evSet, worker_fd, EVFILT_WRITE, worker_polling ? EV_ADD : EV_DELETE, 0, 0,
+		    NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			err(1, "failed to register WRITE event");
+	}
+	if ((worker_len > 0) && (worker_off == worker_len) && worker_held)
+		worker_send(kq);
+}
+
+void
+worker_close(int kq) {
+	struct kevent evSet;
+
+	if (worker_polling) {
+		EV_SET(&evSet, worker_fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(kq, &evSet, 1, NULL, 0, NULL);
+		worker_polling = 0;
+	}
+	close(worker_fd);
+	worker_fd = -1;
+	worker_off = worker_len = 0;
+}
+
+/*
+ * Routes
+ *   load_routes  : read a table in which each line has a pattern and the
+ *                  command to run when a matching path changes. Lines with the
+ *                  same command form one route
+ *   route_changes: pass each changed path to the routes with a pattern that
+ *                  matches. Every route is run if no paths were recorded, such
+ *                  as when the space bar is pressed
+ *   route_start  : start routes with changes that are not already running, up
+ *                  to the job limit. A route that is running collects further
+ *                  changes and is run once more when it exits
+ *   route_reap   : collect the exit status of a route
+ *   route_exit   : start waiting routes after one exits
+ */
+
+void
+load_routes(const char *path) {
+	FILE *fp;
+	char *line = NULL;
+	char *pattern, *command;
+	size_t size = 0;
+	ssize_t len;
+	void *p;
+	int i, lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "unable to open route table '%s'", path);
+	while ((len = getline(&line, &size, fp)) != -1) {
+		lineno++;
+		if ((len > 0) && (line[len - 1] == '\n'))
+			line[len - 1] = '\0';
+		pattern = line + strspn(line, " \t");
+		if ((*pattern == '\0') || (*pattern == '#'))
+			continue;
+		command = pattern + strcspn(pattern, " \t");
+		if (*command != '\0')
+			*command++ = '\0';
+		command += strspn(command, " \t");
+		if (*command == '\0')
+			errx(1, "%s:%d: no command for '%s'", path, lineno, pattern);
+
+		for (i = 0; i < n_routes; i++) {
+			if (strcmp(routes[i].command, command) == 0)
 				break;
 		}
-		if (ret != 0)
-			err(1, "exec %s", new_argv[0]);
+		if (i == n_routes) {
+			if ((p = realloc(routes, (n_routes + 1) * sizeof(Route))) == NULL)
+				err(1, "realloc");
+			routes = p;
+			memset(&routes[i], 0, sizeof(Route));
+			if ((routes[i].command = strdup(command)) == NULL)
+				err(1, "strdup");
+			if ((routes[i].name = strndup(command, strcspn(command, " \t"))) == NULL)
+				err(1, "strndup");
+			n_routes++;
+		}
+		if ((p = realloc(patterns, (n_patterns + 1) * sizeof(RoutePattern))) == NULL)
+			err(1, "realloc");
+		patterns = p;
+		if ((patterns[n_patterns].pattern = strdup(pattern)) == NULL)
+			err(1, "strdup");
+		patterns[n_patterns++].route = i;
 	}
-	child_pid = pid;
+	if (ferror(fp))
+		err(1, "unable to read route table '%s'", path);
+	free(line);
+	fclose(fp);
+	if (n_routes == 0)
+		errx(1, "no routes in '%s'", path);
+}
+
+void
+route_changes(int kq) {
+	Route *r;
+	int i, j;
+
+	for (i = 0; i < changed.n; i++) {
+		for (j = 0; j < n_patterns; j++) {
+			if (fnmatch(patterns[j].pattern, changed.path[i], 0) != 0)
+				continue;
+			r = &routes[patterns[j].route];
+			add_path(&r->paths, changed.path[i]);
+			r->pending = 1;
+		}
+	}
+	if (changed.n == 0) {
+		for (i = 0; i < n_routes; i++)
+			routes[i].pending = 1;
+	}
+	clear_paths(&changed);
+	route_start(kq);
+}
+
+void
+route_start(int kq) {
+	struct kevent evSet;
+	char fd_buf[16], path[PATH_MAX + 16];
+	int list_fd, n, ret;
+	pid_t pid;
+	Route *r;
+
+	for (n = 0; (n < n_routes) && (n_jobs < max_jobs); n++) {
+		r = &routes[next_route];
+		next_route = (next_route + 1) % n_routes;
+		if (!r->pending || (r->pid > 0))
+			continue;
+		r->pending = 0;
+
+		sort_paths(&r->paths);
+		spawn_argv[2] = r->command;
+		spawn_argv[spawn_subst] = (r->paths.n > 0) ? r->paths.path[0] : leading_edge->fn;
+		list_fd = -1;
+		if (list_opt && ((list_fd = write_paths(&r->paths)) != -1)) {
+			snprintf(fd_buf, sizeof(fd_buf), "%d", list_fd);
+			setenv("ENTR_CHANGED_FD", fd_buf, 1);
+		}
+		/* output from routes that are already running is not erased */
+		if (n_jobs == 0) {
+			if (clear_opt == 1)
+				printf("\033[2J\033[H");
+			if (clear_opt == 2)
+				printf("\033[2J\033[3J\033[H");
+			fflush(stdout);
+		}
+
+		r->start_us = trace_now();
+		ret = spawn_utility(&pid, &spawn_actions);
+		if (list_fd != -1) {
+			unsetenv("ENTR_CHANGED_FD");
+			close(list_fd);
+		}
+		clear_paths(&r->paths);
+		if (ret != 0) {
+			errno = ret;
+			warn("exec %s", spawn_argv[0]);
+			print_child_status(W_EXITCODE(1, 0), NULL, 0, r->name);
+			continue;
+		}
+		r->pid = pid;
+		n_jobs++;
+
+		trace_stats.runs++;
+		if ((trace_fd != -1) && (change_us != 0)) {
+			trace_hist_add(&trace_stats.latency, r->start_us - change_us);
+			trace_write("fork", "\"pid\":%d,\"latency_us\":%llu,\"route\":%s", pid,
+			    (unsigned long long) (r->start_us - change_us),
+			    trace_string(path, sizeof(path), r->command));
+		} else if (trace_fd != -1)
+			trace_write("fork", "\"pid\":%d,\"route\":%s", pid,
+			    trace_string(path, sizeof(path), r->command));
+
+		/* the utility may have exited already */
+		EV_SET(&evSet, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, r);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1) {
+			if (errno != ESRCH)
+				err(1, "failed to register PROC event");
+			route_reap(r);
+		}
+	}
+	change_us = 0;
+}
 
-	if (restart_opt == 0 && oneshot_opt == 0) {
-		if (waitpid(child_pid, &status, 0) != -1)
-			child_status = status;
+void
+route_reap(Route *r) {
+	struct rusage ru;
+	uint64_t wall_us;
+	int status;
 
-		print_child_status(child_status);
+	if (wait4(r->pid, &status, 0, &ru) != -1) {
+		wall_us = trace_now() - r->start_us;
+		trace_exit(r->pid, status, &ru, wall_us);
+		print_child_status(status, &ru, wall_us, r->name);
 	}
+	r->pid = 0;
+	n_jobs--;
+}
+
+void
+route_exit(int kq, Route *r) {
+	if (r->pid > 0)
+		route_reap(r);
+	route_start(kq);
+}
+
+void
+report_entry(const char *name, int added, void *arg) {
+	WatchFile *dir = arg;
+	char path[PATH_MAX];
+
+	if (join_path(path, dir->fn, name) == -1)
+		return;
+	if (trace_opt)
+		fprintf(stderr, "%s: %s\n", added ? "added" : "removed", path);
+	if (track_changed)
+		add_changed(path);
+}
 
-	free(arg_buf);
-	free(new_argv);
+/*
+ * Compare a directory to the snapshot taken at startup. Returns the number of
+ * entries added or removed
+ */
+int
+compare_dir_contents(WatchFile *file, int report) {
+	Snapshot *s;
+	int changes;
+
+	if ((s = snapshot_take(file->fn, dirwatch_opt == 2)) == NULL)
+		return 1; /* the directory itself was removed */
+	changes = snapshot_diff(file->snapshot, s, report ? report_entry : NULL, file);
+	snapshot_free(s);
+	return changes;
 }
 
 /*
- * Wait for file to become accessible and register a kevent to watch it
+ * A directory that differs from its snapshot is compared again on a timer
+ * rather than blocking the watch loop, so that temporary files which are
+ * quickly removed are not reported
  */
 void
-watch_file(int kq, WatchFile *file) {
+settle_dir(int kq, WatchFile *file) {
 	struct kevent evSet;
-	int i = 0;
-	struct timespec delay = { 0, 100 * 1000000 };
+	WatchFile **p;
 
-	/* wait up to 1 second for file to become available */
-	for (;;) {
-#if defined(O_EVTONLY)
-		file->fd = open(file->fn, O_RDONLY | O_CLOEXEC | O_EVTONLY | O_SYMLINK);
-#elif defined(O_PATH)
-		file->fd = open(file->fn, O_RDONLY | O_CLOEXEC | O_PATH | O_NOFOLLOW);
-#else
-		file->fd = open(file->fn, O_RDONLY | O_CLOEXEC);
-#endif
-		if (file->fd == -1) {
-			if (i < 10)
-				nanosleep(&delay, NULL);
-			else {
-				warn("cannot open '%s'", file->fn);
-				terminate_utility();
-				exit(1);
-			}
-		} else
-			break;
-		i++;
+	if ((file->settle > 0) || (compare_dir_contents(file, 0) == 0))
+		return;
+	if (n_settle == settle_size) {
+		settle_size = settle_size ? settle_size * 2 : 8;
+		if ((p = realloc(settle_list, settle_size * sizeof(WatchFile *))) == NULL)
+			err(1, "realloc");
+		settle_list = p;
+	}
+	settle_list[n_settle++] = file;
+	file->settle = SETTLE_CHECKS;
+	if (n_settle == 1) {
+		EV_SET(&evSet, SETTLE_TIMER, EVFILT_TIMER, EV_ADD, 0, SETTLE_INTERVAL, NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			err(1, "failed to register TIMER event");
 	}
+}
 
-	EV_SET(&evSet, file->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_ALL, 0, file);
-	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1) {
-		if (errno == ENOSPC)
-			errx(1,
-			    "Unable to allocate memory for kernel queue."
-			    " Please consult"
-			    " http://eradman.com/entrproject/limits.html");
-		else
-			err(1, "failed to register VNODE event");
+/*
+ * Compare each directory that has not settled. Returns the number of
+ * directories that remain altered after the last check
+ */
+int
+settle_check(int kq) {
+	struct kevent evSet;
+	WatchFile *file;
+	int i, j, modified = 0;
+
+	for (i = 0, j = 0; i < n_settle; i++) {
+		file = settle_list[i];
+		if (compare_dir_contents(file, 0) == 0)
+			file->settle = 0;
+		else if (--file->settle == 0) {
+			if (trace_opt || track_changed)
+				compare_dir_contents(file, 1);
+			modified++;
+		} else
+			settle_list[j++] = file;
+	}
+	n_settle = j;
+	if (n_settle == 0) {
+		EV_SET(&evSet, SETTLE_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+			err(1, "failed to remove TIMER event");
 	}
+	return modified;
 }
 
 /*
- * Wait for directory contents to stabilize
+ * Delay the utility until no changes are seen for the quiet period, but not
+ * longer than the maximum measured from the first change. Returns 1 if the
+ * utility should be run now
  */
 int
-compare_dir_contents(WatchFile *file) {
-	int i;
-	struct timespec delay = { 0, 100 * 1000000 };
+debounce(int kq) {
+	struct kevent evSet;
+	struct timespec now;
+	long elapsed, wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((debounce_start.tv_sec == 0) && (debounce_start.tv_nsec == 0))
+		debounce_start = now;
+	elapsed = (now.tv_sec - debounce_start.tv_sec) * 1000
+	    + (now.tv_nsec - debounce_start.tv_nsec) / 1000000;
+	wait = MIN(debounce_ms, debounce_max_ms - elapsed);
+	if (wait <= 0)
+		return 1;
+	trace_stats.deferred++;
+	if (trace_fd != -1)
+		trace_write("coalesce", "\"decision\":\"defer\",\"wait_ms\":%ld", wait);
+
+	/* adding an existing timer resets it */
+	EV_SET(&evSet, DEBOUNCE_TIMER, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, wait, NULL);
+	if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
+		err(1, "failed to register TIMER event");
+	return 0;
+}
 
-	/* wait up to 0.5 seconds for file to become available */
-	for (i = 0; i < 5; i++) {
-		if (list_dir(file->fn) == file->file_count)
-			return 0;
-		nanosleep(&delay, NULL);
+void
+debounce_cancel(int kq) {
+	struct kevent evSet;
+
+	if ((debounce_start.tv_sec == 0) && (debounce_start.tv_nsec == 0))
+		return;
+	debounce_start.tv_sec = 0;
+	debounce_start.tv_nsec = 0;
+	/* fails if the timer has already fired */
+	EV_SET(&evSet, DEBOUNCE_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	kevent(kq, &evSet, 1, NULL, 0, NULL);
+}
+
+/*
+ * Wait for events, growing the event list while it continues to fill so that
+ * a burst is drained using a small number of calls. The list shrinks again
+ * once the load subsides
+ */
+int
+read_events(int kq, const struct timespec *timeout) {
+	const struct timespec zero = { 0, 0 };
+	struct kevent *p;
+	int n, nev;
+
+	if (evList == NULL) {
+		ev_size = EV_LIST_MIN;
+		if ((evList = calloc(ev_size, sizeof(struct kevent))) == NULL)
+			err(1, "calloc");
 	}
-	return 1;
+
+	nev = kevent(kq, NULL, 0, evList, ev_size, timeout);
+	batch_stats.calls++;
+	while ((nev == ev_size) && (ev_size < EV_LIST_MAX)) {
+		ev_size *= 2;
+		if ((p = realloc(evList, ev_size * sizeof(struct kevent))) == NULL)
+			err(1, "realloc");
+		evList = p;
+		n = kevent(kq, NULL, 0, evList + nev, ev_size - nev, &zero);
+		batch_stats.calls++;
+		if (n <= 0)
+			break;
+		nev += n;
+	}
+	if ((nev >= 0) && (nev * 8 < ev_size) && (ev_size > EV_LIST_MIN)) {
+		ev_size /= 2;
+		if ((p = realloc(evList, ev_size * sizeof(struct kevent))) != NULL)
+			evList = p;
+	}
+
+	if (nev > 0) {
+		batch_stats.batches++;
+		batch_stats.events += nev;
+		batch_stats.max_batch = MAX(batch_stats.max_batch, nev);
+	}
+	return nev;
 }
 
 /*
  * Wait for events to and execute a command. Four major concerns are in play:
  *   leading_edge: Global reference to the first file to have changed
- *   reopen_only : Unlink or rename events which require us to spin while
- *                 waiting for the file to reappear. These must always be
- *                 processed
+ *   reopen_only : Unlink or rename events which require the file to be opened
+ *                 again once it reappears. These must always be processed
  *   collate_only: Changes that indicate that more events are likely to occur.
  *                 Watch for more events using a short timeout
  *   do_exec     : Delay execution until all events have been processed. Allow
  *                 the user to edit files while the utility is running without
  *                 any visible side-effects
  *   dir_modified: The number of files changed for a directory under watch
+ *   scan_list   : Directories in a recursive tree to be updated in place
+ *   immediate   : Run without waiting for a quiet period
  */
 void
-watch_loop(int kq, char *argv[]) {
+watch_loop(int kq) {
 	struct kevent evSet;
-	struct kevent evList[32];
 	int nev;
 	WatchFile *file;
-	int i;
+	int i, n;
 	struct timespec evTimeout = { 0, 1000000 };
 	int reopen_only = !aggressive_opt;
 	int collate_only = 0;
 	int do_exec = 0;
 	int dir_modified = 0;
+	int immediate = 0;
+	int absent_changed = 0;
 	int leading_edge_set = 0;
+	uint64_t batch_us = 0;
 	struct stat sb;
 	char c;
+	char path[PATH_MAX + 16];
 	struct termios character_tty;
 
 	leading_edge = files[0]; /* default */
-	if (postpone_opt == 0)
-		run_utility(argv);
+	if ((postpone_opt == 0) && table_opt)
+		route_changes(kq);
+	else if (postpone_opt == 0)
+		run_utility(kq);
+	work_finish(&register_queue);
+	if (register_queue.failed != -1)
+		watch_failed(files[register_queue.failed], register_queue.status,
+		    register_queue.error);
+	if (index_path != NULL)
+		save_index();
 
 	if (!noninteractive_opt) {
 		/* disabling/restore line buffering and local echo */
@@ -727,22 +3321,102 @@ watch_loop(int kq, char *argv[]) {
 	}
 
 main:
+	/* events that refer to pruned files have been processed */
+	if (n_removed > 0)
+		free_removed();
+
+	poll_schedule(kq);
+
+	/* changes made by the utility are received before it is reaped */
+	if (child_exited) {
+		child_exited = 0;
+		child_exit(kq);
+		if (!aggressive_opt && !restart_opt && !worker_opt)
+			reopen_only = 1;
+	}
+
 	if (!noninteractive_opt) {
 		tcsetattr(STDIN_FILENO, TCSADRAIN, &character_tty);
 		termios_set = 1;
 	}
 
 	if ((reopen_only == 1) || (collate_only == 1)) {
-		nev = kevent(kq, NULL, 0, evList, 32, &evTimeout);
+		nev = read_events(kq, &evTimeout);
 	} else {
-		nev = kevent(kq, NULL, 0, evList, 32, NULL);
+		nev = read_events(kq, NULL);
 		dir_modified = 0;
 	}
 
 	if ((nev == -1) && (errno != EINTR))
 		warn("kevent failed");
 
+	if ((trace_fd != -1) && (nev > 0)) {
+		batch_us = trace_now();
+		trace_write("batch", "\"events\":%d", nev);
+		for (i = 0; i < nev; i++)
+			trace_kevent(&evList[i]);
+	}
+
+	if (trace_opt && (nev > 0)) {
+		fprintf(stderr, "batch: %d events, %lu calls, %lu events in %lu batches, max %d\n",
+		    nev, batch_stats.calls, batch_stats.events, batch_stats.batches,
+		    batch_stats.max_batch);
+#if defined(_LINUX_PORT)
+		fprintf(stderr, "inotify: %lu reads, %lu bytes, buffer %zu, %zu watches\n",
+		    inotify_stats.reads, inotify_stats.bytes, inotify_stats.buf_size,
+		    inotify_stats.watches);
+#endif
+	}
+
 	for (i = 0; i < nev; i++) {
+		if ((evList[i].filter == EVFILT_READ) && ((int) evList[i].ident == signal_pipe[0])) {
+			signal_exit();
+			continue;
+		}
+		if ((evList[i].filter == EVFILT_READ) && ((int) evList[i].ident == input_fd)) {
+			follow_input(kq);
+			continue;
+		}
+		if ((evList[i].filter == EVFILT_TIMER) && (evList[i].ident == SETTLE_TIMER)) {
+			n = settle_check(kq);
+			/* the utility is run once more unless it is persistent */
+			if ((n > 0) && (restart_opt == 0))
+				do_exec = immediate = 1;
+			dir_modified += n;
+			continue;
+		}
+		if ((evList[i].filter == EVFILT_TIMER) && (evList[i].ident == REOPEN_TIMER)) {
+			reopen_check(kq);
+			continue;
+		}
+		/* changes are appended and handled in this pass */
+		if ((evList[i].filter == EVFILT_TIMER) && (evList[i].ident == POLL_TIMER)) {
+			nev = poll_scan(nev);
+			continue;
+		}
+		if ((evList[i].filter == EVFILT_TIMER) && (evList[i].ident == DEBOUNCE_TIMER)) {
+			do_exec = immediate = 1;
+			continue;
+		}
+		if ((evList[i].filter == EVFILT_TIMER) && (evList[i].ident == RESTART_TIMER)) {
+			if (stopping && (child_pid > 0)) {
+				if (trace_fd != -1)
+					trace_write("kill", "\"pid\":%d,\"signal\":%d", child_pid, SIGKILL);
+				killpg(child_pid, SIGKILL);
+			}
+			continue;
+		}
+		if ((evList[i].filter == EVFILT_WRITE) && ((int) evList[i].ident == worker_fd)) {
+			worker_flush(kq);
+			continue;
+		}
+		if (evList[i].filter == EVFILT_PROC) {
+			if (evList[i].udata == NULL)
+				child_exited = 1;
+			else
+				route_exit(kq, (Route *) evList[i].udata);
+			continue;
+		}
 		if (!noninteractive_opt && evList[i].filter == EVFILT_READ) {
 			if (read(STDIN_FILENO, &c, 1) < 1) {
 				EV_SET(&evSet, STDIN_FILENO, EVFILT_READ, EV_DELETE, NOTE_LOWAT, 0, NULL);
@@ -750,7 +3424,7 @@ main:
 					err(1, "failed to remove READ event");
 			} else {
 				if (c == ' ')
-					do_exec = 1;
+					do_exec = immediate = 1;
 				if (c == 'q')
 					kill(getpid(), SIGINT);
 			}
@@ -759,9 +3433,23 @@ main:
 			continue;
 
 		file = (WatchFile *) evList[i].udata;
-		if (file->is_dir == 1)
-			dir_modified += compare_dir_contents(file);
+		if ((n_reopen > n_reopening) && file->is_dir)
+			absent_changed = 1;
+		if (file->is_parent)
+			continue;
+		if (file->index_entry != -1)
+			queue_update(file);
+		if (file->is_tree == 1)
+			queue_scan(file);
+		else if (file->is_dir == 1)
+			settle_dir(kq, file);
 	}
+	for (i = 0; i < n_scan; i++) {
+		scan_list[i]->is_queued = 0;
+		if (!scan_list[i]->is_removed && (scan_dir(kq, scan_list[i]) > 0))
+			do_exec = 1;
+	}
+	n_scan = 0;
 	if (!noninteractive_opt)
 		tcsetattr(STDIN_FILENO, TCSADRAIN, &canonical_tty);
 
@@ -770,22 +3458,40 @@ main:
 		if (evList[i].filter != EVFILT_VNODE)
 			continue;
 		file = (WatchFile *) evList[i].udata;
+		if (file->is_removed || file->is_parent)
+			continue;
 		if (evList[i].fflags & NOTE_DELETE || evList[i].fflags & NOTE_RENAME) {
-			EV_SET(&evSet, file->fd, EVFILT_VNODE, EV_DELETE, NOTE_ALL, 0, file);
-			if (kevent(kq, &evSet, 1, NULL, 0, NULL) == -1)
-				err(1, "failed to remove VNODE event");
-#if !defined(_LINUX_PORT)
-			/* free file descriptor no longer monitored by kqueue */
-			if ((file->fd != -1) && (close(file->fd) == -1))
-				err(1, "unable to close file");
-#endif
-			watch_file(kq, file);
+			/* files within a recursive tree are allowed to disappear */
+			if ((file->parent != NULL) && (xstat(file->fn, &sb) == -1)) {
+				prune_file(kq, file);
+				do_exec = 1;
+				continue;
+			}
+			unwatch_file(kq, file);
+			reopen_file(kq, file);
 			collate_only = 1;
 		}
 	}
+	/* a file that reappeared may still be written */
+	if (absent_changed) {
+		absent_changed = 0;
+		if ((file = absent_check(kq)) != NULL) {
+			do_exec = collate_only = 1;
+			if (leading_edge_set == 0) {
+				leading_edge = file;
+				leading_edge_set = 1;
+			}
+		}
+	}
 	if (reopen_only == 1) {
 		reopen_only = 0;
-		goto main;
+		/* other events are consolidated, but not a command or altered directory */
+		if ((do_exec == 0) && (dir_modified == 0)) {
+			if ((trace_fd != -1) && (nev > 0))
+				trace_write("coalesce", "\"decision\":\"consolidate\",\"events\":%d", nev);
+			goto main;
+		}
+		goto exec;
 	}
 
 	for (i = 0; i < nev && reopen_only == 0; i++) {
@@ -793,6 +3499,8 @@ main:
 		if (evList[i].filter != EVFILT_VNODE)
 			continue;
 		file = (WatchFile *) evList[i].udata;
+		if (file->is_removed || file->is_parent)
+			continue;
 		if ((file->is_dir == 1) && (dir_modified == 0))
 			continue;
 
@@ -800,7 +3508,13 @@ main:
 		    || evList[i].fflags & NOTE_RENAME || evList[i].fflags & NOTE_TRUNCATE) {
 			if ((dir_modified > 0) && (restart_opt == 1))
 				continue;
-			do_exec = 1;
+			if (identical_opt && (S_ISREG(file->mode) != 0))
+				queue_check(file);
+			else {
+				do_exec = 1;
+				if (track_changed && (file->is_dir == 0))
+					add_changed(file->fn);
+			}
 		}
 
 		if (evList[i].fflags & NOTE_ATTRIB && S_ISREG(file->mode) != 0
@@ -808,12 +3522,23 @@ main:
 			if (file->mode != sb.st_mode) {
 				do_exec = 1;
 				file->mode = sb.st_mode;
+				if (track_changed)
+					add_changed(file->fn);
 			}
 			if (file->ino != sb.st_ino) {
 #if defined(_LINUX_PORT)
-				do_exec = 1;
+				if (identical_opt)
+					queue_check(file);
+				else {
+					do_exec = 1;
+					if (track_changed)
+						add_changed(file->fn);
+				}
 #endif
+				/* the inode number is a key */
+				table_remove(&inode_table, file);
 				file->ino = sb.st_ino;
+				table_insert(&inode_table, file);
 			}
 		} else if (evList[i].fflags & NOTE_ATTRIB)
 			continue;
@@ -823,23 +3548,88 @@ main:
 			leading_edge_set = 1;
 		}
 
-		if (getenv("EV_TRACE")) {
+		if (trace_opt) {
 			fprintf(stderr, "%d/%d: fflags: 0x%x %s %o %s\n", i, nev, evList[i].fflags,
 			    file->is_dir ? "d" : "r", file->mode, file->fn);
 		}
 	}
 
-	if (collate_only == 1)
+	/* only files with new contents count as changed */
+	if (n_check > 0) {
+		work_start(&check_queue, n_check, check_content, check_list);
+		work_finish(&check_queue);
+		for (i = 0; i < n_check; i++) {
+			check_list[i].file->is_queued = 0;
+			if (check_list[i].changed == 0) {
+				trace_stats.unchanged++;
+				if (trace_fd != -1)
+					trace_write("coalesce", "\"decision\":\"unchanged\",\"path\":%s",
+					    trace_string(path, sizeof(path), check_list[i].file->fn));
+				continue;
+			}
+			if (leading_edge_set == 0) {
+				leading_edge = check_list[i].file;
+				leading_edge_set = 1;
+			}
+			do_exec = 1;
+			if (track_changed)
+				add_changed(check_list[i].file->fn);
+		}
+		n_check = 0;
+	}
+
+exec:
+	if (collate_only == 1) {
+		trace_stats.collated++;
+		if (trace_fd != -1)
+			trace_write("coalesce", "\"decision\":\"collate\"");
 		goto main;
+	}
+	/* without -a changes made while the utility is running are not acted on */
+	if ((do_exec == 1) && (child_pid > 0) && (immediate == 0) && !aggressive_opt
+	    && !restart_opt && !worker_opt) {
+		do_exec = 0;
+		clear_paths(&changed);
+		if (trace_fd != -1)
+			trace_write("coalesce", "\"decision\":\"running\"");
+	}
+	if ((do_exec == 1) && (change_us == 0))
+		change_us = batch_us;
+	/* files that were replaced are given time to reappear */
+	if ((do_exec == 1) && (n_reopening > 0) && (dir_modified == 0)) {
+		if (trace_fd != -1)
+			trace_write("coalesce", "\"decision\":\"reopen\",\"files\":%d", n_reopening);
+		goto main;
+	}
+	if ((do_exec == 1) && (debounce_ms > 0) && (immediate == 0) && (dir_modified == 0)) {
+		if (debounce(kq) == 0)
+			do_exec = 0;
+	}
 	if (do_exec == 1) {
 		do_exec = 0;
-		run_utility(argv);
-		if (!aggressive_opt)
+		immediate = 0;
+		debounce_cancel(kq);
+		if (n_stale > 0)
+			update_index();
+		/* a persistent utility or routes are not waited for, so there is nothing to consolidate */
+		if (worker_opt)
+			worker_send(kq);
+		else if (table_opt)
+			route_changes(kq);
+		else
+			run_utility(kq);
+		if (!aggressive_opt && !worker_opt && !table_opt)
 			reopen_only = 1;
 		leading_edge_set = 0;
 	}
 	if (dir_modified > 0) {
+		/* the utility is allowed to finish unless it is restarted */
+		if ((child_pid > 0) && !restart_opt && !worker_opt) {
+			run_pending = 0;
+			child_exit(kq);
+		}
 		terminate_utility();
+		trace_summary();
 		errx(2, "directory altered");
 	}
 
@@ -0,0 +1,222 @@
+/*
+ * hash.c
+ * open addressing tables of file records and content fingerprints
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data.h"
+#include "hash.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+#define MIX_P1 11400714785074694791ULL
+#define MIX_P2 14029467366897019727ULL
+#define MIX_P3 1609587929392839161ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* forwards */
+
+static void table_grow(FileTable *);
+static void hash_block(uint64_t *, const unsigned char *);
+
+/*
+ * A table stores references to file records; the key is derived from the
+ * record itself using the hash and equal functions. Lookups are done by
+ * filling out the key fields of a record on the stack
+ */
+void
+table_init(FileTable *t, size_t (*hash)(const WatchFile *),
+    int (*equal)(const WatchFile *, const WatchFile *)) {
+	t->slot = NULL;
+	t->size = 0;
+	t->count = 0;
+	t->hash = hash;
+	t->equal = equal;
+}
+
+WatchFile *
+table_find(FileTable *t, const WatchFile *key) {
+	size_t i;
+
+	if (t->count == 0)
+		return NULL;
+	for (i = t->hash(key) & (t->size - 1); t->slot[i] != NULL; i = (i + 1) & (t->size - 1)) {
+		if (t->equal(t->slot[i], key))
+			return t->slot[i];
+	}
+	return NULL;
+}
+
+void
+table_insert(FileTable *t, WatchFile *file) {
+	size_t i;
+
+	/* keep the load factor under 1/2 */
+	if ((t->count + 1) * 2 > t->size)
+		table_grow(t);
+	for (i = t->hash(file) & (t->size - 1); t->slot[i] != NULL; i = (i + 1) & (t->size - 1)) {
+		if (t->equal(t->slot[i], file)) {
+			t->slot[i] = file;
+			return;
+		}
+	}
+	t->slot[i] = file;
+	t->count++;
+}
+
+void
+table_remove(FileTable *t, WatchFile *file) {
+	size_t i, j, k;
+	size_t mask = t->size - 1;
+
+	if (t->count == 0)
+		return;
+	for (i = t->hash(file) & mask; t->slot[i] != file; i = (i + 1) & mask) {
+		if (t->slot[i] == NULL)
+			return;
+	}
+
+	/* backward shift deletion so that probe sequences remain intact */
+	for (j = (i + 1) & mask; t->slot[j] != NULL; j = (j + 1) & mask) {
+		k = t->hash(t->slot[j]) & mask;
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		t->slot[i] = t->slot[j];
+		i = j;
+	}
+	t->slot[i] = NULL;
+	t->count--;
+}
+
+void
+table_grow(FileTable *t) {
+	WatchFile **old_slot = t->slot;
+	size_t old_size = t->size;
+	size_t i;
+
+	t->size = t->size ? t->size * 2 : 256;
+	t->slot = calloc(t->size, sizeof(WatchFile *));
+	if (t->slot == NULL)
+		err(1, "calloc");
+	t->count = 0;
+	for (i = 0; i < old_size; i++) {
+		if (old_slot[i] != NULL)
+			table_insert(t, old_slot[i]);
+	}
+	free(old_slot);
+}
+
+/*
+ * Key functions
+ *   path : the name as it was provided
+ *   inode: device and inode number, which identifies hard links and symlinks
+ *          that resolve to the same file
+ */
+
+size_t
+hash_path(const WatchFile *file) {
+	const unsigned char *p;
+	uint64_t h = FNV_OFFSET;
+
+	for (p = (const unsigned char *) file->fn; *p; p++)
+		h = (h ^ *p) * FNV_PRIME;
+	return (size_t) h;
+}
+
+int
+equal_path(const WatchFile *a, const WatchFile *b) {
+	return strcmp(a->fn, b->fn) == 0;
+}
+
+size_t
+hash_inode(const WatchFile *file) {
+	uint64_t h;
+
+	h = ((uint64_t) file->ino ^ ((uint64_t) file->dev << 32)) * FNV_PRIME;
+	return (size_t) (h ^ (h >> 29));
+}
+
+int
+equal_inode(const WatchFile *a, const WatchFile *b) {
+	return (a->ino == b->ino) && (a->dev == b->dev);
+}
+
+/*
+ * Fingerprint the contents of a file as they are read. Four lanes of eight
+ * bytes are mixed independently so that the loop is not bound by the latency
+ * of each multiply
+ *   hash_init   : start a fingerprint
+ *   hash_update : add the next part of the contents
+ *   hash_final  : mix the remaining bytes and the length into the result
+ */
+void
+hash_init(ContentHash *c) {
+	c->v[0] = MIX_P1 + MIX_P2;
+	c->v[1] = MIX_P2;
+	c->v[2] = 0;
+	c->v[3] = -MIX_P1;
+	c->len = 0;
+	c->n = 0;
+}
+
+static void
+hash_block(uint64_t *v, const unsigned char *p) {
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i < 4; i++) {
+		memcpy(&w, p + i * 8, sizeof(w));
+		v[i] = ROTL(v[i] + w * MIX_P2, 31) * MIX_P1;
+	}
+}
+
+void
+hash_update(ContentHash *c, const unsigned char *p, size_t len) {
+	size_t n;
+
+	c->len += len;
+	if (c->n > 0) {
+		n = MIN(len, sizeof(c->buf) - c->n);
+		memcpy(c->buf + c->n, p, n);
+		c->n += n;
+		p += n;
+		len -= n;
+		if (c->n < sizeof(c->buf))
+			return;
+		hash_block(c->v, c->buf);
+		c->n = 0;
+	}
+	for (; len >= sizeof(c->buf); len -= sizeof(c->buf), p += sizeof(c->buf))
+		hash_block(c->v, p);
+	memcpy(c->buf, p, len);
+	c->n = len;
+}
+
+uint64_t
+hash_final(ContentHash *c) {
+	const unsigned char *p = c->buf;
+	uint64_t h, w;
+	size_t n = c->n;
+
+	h = ROTL(c->v[0], 1) + ROTL(c->v[1], 7) + ROTL(c->v[2], 12) + ROTL(c->v[3], 18) + c->len;
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy(&w, p, sizeof(w));
+		h = ROTL(h ^ (ROTL(w * MIX_P2, 31) * MIX_P1), 27) * MIX_P1 + MIX_P3;
+	}
+	for (; n > 0; n--, p++)
+		h = ROTL(h ^ (*p * MIX_P1), 11) * MIX_P2;
+
+	h ^= h >> 33;
+	h *= MIX_P2;
+	h ^= h >> 29;
+	h *= MIX_P3;
+	return h ^ (h >> 32);
+}
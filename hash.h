@@ -0,0 +1,34 @@
+/*
+ * hash.h
+ * open addressing tables of file records and content fingerprints
+ */
+
+typedef struct {
+	WatchFile **slot;
+	size_t size; /* power of two */
+	size_t count;
+	size_t (*hash)(const WatchFile *);
+	int (*equal)(const WatchFile *, const WatchFile *);
+} FileTable;
+
+typedef struct {
+	uint64_t v[4];
+	uint64_t len;
+	unsigned char buf[32]; /* bytes not yet mixed into a lane */
+	size_t n;
+} ContentHash;
+
+void table_init(FileTable *, size_t (*)(const WatchFile *),
+    int (*)(const WatchFile *, const WatchFile *));
+WatchFile *table_find(FileTable *, const WatchFile *);
+void table_insert(FileTable *, WatchFile *);
+void table_remove(FileTable *, WatchFile *);
+
+size_t hash_path(const WatchFile *);
+int equal_path(const WatchFile *, const WatchFile *);
+size_t hash_inode(const WatchFile *);
+int equal_inode(const WatchFile *, const WatchFile *);
+
+void hash_init(ContentHash *);
+void hash_update(ContentHash *, const unsigned char *, size_t);
+uint64_t hash_final(ContentHash *);
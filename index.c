@@ -0,0 +1,183 @@
+/*
+ * index.c
+ * persistent record of the watch list kept between sessions
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "missing/compat.h"
+
+#include "data.h"
+#include "index.h"
+
+/*
+ * The index is a header followed by one entry for each file and then the path
+ * names. It is mapped so that entries can be updated in place each time the
+ * utility is run. A file with a different magic number or version, or one
+ * that is truncated, is not used
+ *   index_open   : map an index, which is written in place if writable is set
+ *   index_name   : path name of an entry
+ *   index_write  : replace the index with the state of the watch list
+ *   index_update : record the state of one file
+ */
+
+int
+index_open(Index *idx, const char *path, int writable) {
+	struct stat sb;
+	void *map;
+	size_t len;
+	int fd;
+
+	idx->header = NULL;
+	if ((fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC)) == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t) sb.st_size < sizeof(struct index_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, sb.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+	    fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	idx->header = map;
+	idx->len = sb.st_size;
+
+	len = sizeof(struct index_header) + idx->header->count * sizeof(struct index_entry)
+	    + idx->header->names_len;
+	if ((memcmp(idx->header->magic, INDEX_MAGIC, sizeof(idx->header->magic)) != 0)
+	    || (idx->header->version != INDEX_VERSION) || (len != idx->len)) {
+		index_close(idx);
+		errno = EINVAL;
+		return -1;
+	}
+	idx->entry = (struct index_entry *) (idx->header + 1);
+	idx->names = (const char *) (idx->entry + idx->header->count);
+	return 0;
+}
+
+void
+index_close(Index *idx) {
+	if (idx->header != NULL)
+		munmap(idx->header, idx->len);
+	idx->header = NULL;
+}
+
+const char *
+index_name(const Index *idx, uint32_t i) {
+	const char *name = idx->names + idx->entry[i].name;
+
+	if ((idx->entry[i].name >= idx->header->names_len)
+	    || (memchr(name, '\0', idx->header->names_len - idx->entry[i].name) == NULL))
+		return "";
+	return name;
+}
+
+/*
+ * Write to a temporary file that is renamed so that a session never reads an
+ * index that is partially written
+ */
+int
+index_write(const char *path, WatchFile **files, int n) {
+	char tmp[PATH_MAX];
+	struct index_header *header;
+	struct index_entry *e;
+	char *names;
+	size_t names_len, len, off;
+	void *map;
+	int i, fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	names_len = 0;
+	for (i = 0; i < n; i++)
+		names_len += strlen(files[i]->fn) + 1;
+	if (names_len > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	len = sizeof(struct index_header) + n * sizeof(struct index_entry) + names_len;
+
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return -1;
+	if (ftruncate(fd, len) == -1)
+		goto fail;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	header = map;
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->version = INDEX_VERSION;
+	header->count = n;
+	header->names_len = names_len;
+	e = (struct index_entry *) (header + 1);
+	names = (char *) (e + n);
+	off = 0;
+	for (i = 0; i < n; i++, e++) {
+		e->ino = files[i]->ino;
+		e->size = files[i]->size;
+		e->mtime_sec = files[i]->mtime.tv_sec;
+		e->mtime_nsec = files[i]->mtime.tv_nsec;
+		e->digest = files[i]->has_digest ? files[i]->digest : 0;
+		e->flags = files[i]->has_digest ? INDEX_DIGEST : 0;
+		e->name = off;
+		memcpy(names + off, files[i]->fn, strlen(files[i]->fn) + 1);
+		off += strlen(files[i]->fn) + 1;
+	}
+	munmap(map, len);
+	close(fd);
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+fail:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/*
+ * The fingerprint is kept only if it was taken from the same version of the
+ * file. sb is NULL if the file could not be found
+ */
+void
+index_update(Index *idx, uint32_t i, const struct stat *sb, const WatchFile *file) {
+	struct index_entry *e = &idx->entry[i];
+
+	if (sb == NULL) {
+		memset(e, 0, offsetof(struct index_entry, name));
+		e->flags = INDEX_MISSING;
+		return;
+	}
+	e->ino = sb->st_ino;
+	e->size = sb->st_size;
+	e->mtime_sec = sb->st_mtim.tv_sec;
+	e->mtime_nsec = sb->st_mtim.tv_nsec;
+	e->flags = 0;
+	e->digest = 0;
+	if (file->has_digest && (file->size == sb->st_size)
+	    && (file->mtime.tv_sec == sb->st_mtim.tv_sec)
+	    && (file->mtime.tv_nsec == sb->st_mtim.tv_nsec)) {
+		e->digest = file->digest;
+		e->flags = INDEX_DIGEST;
+	}
+}
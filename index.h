@@ -0,0 +1,41 @@
+/*
+ * index.h
+ * persistent record of the watch list kept between sessions
+ */
+
+#define INDEX_MAGIC "entridx"
+#define INDEX_VERSION 1
+
+/* entry flags */
+#define INDEX_DIGEST 1  /* digest holds a fingerprint of the contents */
+#define INDEX_MISSING 2 /* the file could not be found */
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t names_len;
+};
+
+struct index_entry {
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t digest;
+	uint32_t name; /* offset into the path names */
+	uint32_t flags;
+};
+
+typedef struct {
+	struct index_header *header;
+	struct index_entry *entry;
+	const char *names;
+	size_t len;
+} Index;
+
+int index_open(Index *, const char *, int);
+void index_close(Index *);
+const char *index_name(const Index *, uint32_t);
+int index_write(const char *, WatchFile **, int);
+void index_update(Index *, uint32_t, const struct stat *, const WatchFile *);
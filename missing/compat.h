@@ -7,6 +7,39 @@
 #if defined(_LINUX_PORT)
 #define INOTIFY_MAX_USER_WATCHES 2
 int fs_sysctl(const int name);
+
+struct inotify_stats {
+	unsigned long reads;
+	unsigned long bytes;
+	size_t buf_size;
+	size_t watches;
+};
+extern struct inotify_stats inotify_stats;
+
+/* ENTR_BACKEND */
+#define BACKEND_INOTIFY 0
+#define BACKEND_FANOTIFY 1
+#define BACKEND_INOTIFY_DIR 2
+int select_backend(void);
+
+struct kevent;
+struct watch_file;
+int fan_init(void);
+int fan_add_watch(struct watch_file *file);
+void fan_rm_watch(struct watch_file *file);
+int fan_pending(void);
+int fan_read(struct kevent *eventlist, int n, int nevents);
+
+/* file systems that are polled; not defined by older kernel headers */
+#if !defined(CIFS_SUPER_MAGIC)
+#define CIFS_SUPER_MAGIC 0xff534d42
+#endif
+#if !defined(SMB2_SUPER_MAGIC)
+#define SMB2_SUPER_MAGIC 0xfe534d42
+#endif
+#if !defined(FUSE_SUPER_MAGIC)
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
 #endif
 
 #if !defined(ARG_MAX)
@@ -16,3 +49,7 @@ int fs_sysctl(const int name);
 #ifndef __OpenBSD__
 #define pledge(s, p) (0)
 #endif
+
+#if defined(_MACOS_PORT) && !defined(st_mtim)
+#define st_mtim st_mtimespec
+#endif
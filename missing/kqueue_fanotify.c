@@ -0,0 +1,464 @@
+/*
+ * kqueue_fanotify.c
+ * watch entire file systems using fanotify(7) on Linux
+ *
+ * Appended to kqueue_inotify.c to form compat.c, which includes
+ * sys/event.h, compat.h and data.h
+ */
+
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * One mark is placed on each file system, so the kernel reports every
+ * change. Events identify the parent directory using a file handle and the
+ * entry by name; these are matched against the input list in user space.
+ *   fan_dir  : a directory identified by file system id and handle. If the
+ *              directory itself is under watch, self refers to it
+ *   fan_name : an entry in a directory that is under watch
+ * Each file refers to the directory record that holds it so that it can be
+ * removed without a search
+ */
+
+#define FAN_KEY_MAX (sizeof(fsid_t) + sizeof(int) + MAX_HANDLE_SZ)
+#define FAN_MARKS_MAX 64
+#define FAN_WATCH                                                                                    \
+	FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO         \
+	    | FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR
+
+struct fan_dir {
+	size_t hash;
+	size_t key_len;
+	unsigned char *key;
+	WatchFile *self;
+};
+
+struct fan_name {
+	struct fan_dir *dir;
+	const char *name;
+	WatchFile *file;
+};
+
+static int fanotify_fd = -1;
+static fsid_t marks[FAN_MARKS_MAX];
+static int n_marks;
+static int next_ident = 1;
+static uint64_t fan_mask = FAN_WATCH;
+
+static struct fan_dir **dir_table;
+static size_t dir_size; /* power of two */
+static size_t dir_count;
+
+static struct fan_name *name_table;
+static size_t name_size; /* power of two */
+static size_t name_count;
+
+static pthread_mutex_t fan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* events that did not fit in the caller's event list */
+static char fbuf[64 * 1024];
+static ssize_t flen;
+static ssize_t fpos;
+
+/* forwards */
+
+static size_t fan_hash(const void *p, size_t len, size_t h);
+static struct fan_dir *fan_dir_find(const unsigned char *key, size_t key_len, size_t hash);
+static struct fan_dir *fan_dir_get(const char *path);
+static size_t fan_name_slot(struct fan_dir *dir, const char *name);
+static void fan_name_grow(void);
+static void fan_name_remove(size_t i);
+static int fan_mark(const char *path, fsid_t *fsid);
+static int fan_append(struct kevent *eventlist, int n, WatchFile *file, u_int fflags);
+
+/* utility functions */
+
+static size_t
+fan_hash(const void *p, size_t len, size_t h) {
+	const unsigned char *c = p;
+
+	while (len--)
+		h = (h ^ *c++) * 1099511628211ULL;
+	return h;
+}
+
+static struct fan_dir *
+fan_dir_find(const unsigned char *key, size_t key_len, size_t hash) {
+	size_t i;
+
+	if (dir_count == 0)
+		return NULL;
+	for (i = hash & (dir_size - 1); dir_table[i] != NULL; i = (i + 1) & (dir_size - 1)) {
+		if ((dir_table[i]->hash == hash) && (dir_table[i]->key_len == key_len)
+		    && (memcmp(dir_table[i]->key, key, key_len) == 0))
+			return dir_table[i];
+	}
+	return NULL;
+}
+
+/*
+ * Look up or create the record for a directory using its file handle
+ */
+static struct fan_dir *
+fan_dir_get(const char *path) {
+	unsigned char key[FAN_KEY_MAX];
+	struct {
+		struct file_handle fh;
+		unsigned char f_handle[MAX_HANDLE_SZ];
+	} h;
+	struct fan_dir **old_table, *dir;
+	size_t i, old_size, key_len, hash;
+	fsid_t fsid;
+	int mount_id;
+
+	if (fan_mark(path, &fsid) == -1)
+		return NULL;
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, path, &h.fh, &mount_id, 0) == -1)
+		return NULL;
+
+	/* same layout as the fsid and handle reported in an event */
+	memcpy(key, &fsid, sizeof(fsid));
+	memcpy(key + sizeof(fsid), &h.fh.handle_type, sizeof(int));
+	memcpy(key + sizeof(fsid) + sizeof(int), h.fh.f_handle, h.fh.handle_bytes);
+	key_len = sizeof(fsid) + sizeof(int) + h.fh.handle_bytes;
+	hash = fan_hash(key, key_len, 14695981039346656037ULL);
+
+	if ((dir = fan_dir_find(key, key_len, hash)) != NULL)
+		return dir;
+
+	if ((dir_count + 1) * 2 > dir_size) {
+		old_table = dir_table;
+		old_size = dir_size;
+		dir_size = dir_size ? dir_size * 2 : 256;
+		if ((dir_table = calloc(dir_size, sizeof(struct fan_dir *))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < old_size; i++) {
+			if (old_table[i] == NULL)
+				continue;
+			size_t j = old_table[i]->hash & (dir_size - 1);
+			while (dir_table[j] != NULL)
+				j = (j + 1) & (dir_size - 1);
+			dir_table[j] = old_table[i];
+		}
+		free(old_table);
+	}
+
+	if ((dir = calloc(1, sizeof(struct fan_dir))) == NULL)
+		err(1, "calloc");
+	if ((dir->key = malloc(key_len)) == NULL)
+		err(1, "malloc");
+	memcpy(dir->key, key, key_len);
+	dir->key_len = key_len;
+	dir->hash = hash;
+	for (i = hash & (dir_size - 1); dir_table[i] != NULL; i = (i + 1) & (dir_size - 1))
+		;
+	dir_table[i] = dir;
+	dir_count++;
+	return dir;
+}
+
+/*
+ * Returns the slot holding the entry, or the empty slot where it belongs
+ */
+static size_t
+fan_name_slot(struct fan_dir *dir, const char *name) {
+	size_t i;
+
+	for (i = fan_hash(name, strlen(name), dir->hash) & (name_size - 1);
+	    name_table[i].file != NULL; i = (i + 1) & (name_size - 1)) {
+		if ((name_table[i].dir == dir) && (strcmp(name_table[i].name, name) == 0))
+			break;
+	}
+	return i;
+}
+
+static void
+fan_name_grow(void) {
+	struct fan_name *old_table = name_table;
+	size_t old_size = name_size;
+	size_t i, j;
+
+	name_size = name_size ? name_size * 2 : 1024;
+	if ((name_table = calloc(name_size, sizeof(struct fan_name))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < old_size; i++) {
+		if (old_table[i].file == NULL)
+			continue;
+		j = fan_name_slot(old_table[i].dir, old_table[i].name);
+		name_table[j] = old_table[i];
+	}
+	free(old_table);
+}
+
+static void
+fan_name_remove(size_t i) {
+	size_t j, k;
+	size_t mask = name_size - 1;
+
+	/* backward shift deletion so that probe sequences remain intact */
+	for (j = (i + 1) & mask; name_table[j].file != NULL; j = (j + 1) & mask) {
+		k = fan_hash(name_table[j].name, strlen(name_table[j].name), name_table[j].dir->hash)
+		    & mask;
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		name_table[i] = name_table[j];
+		i = j;
+	}
+	name_table[i].file = NULL;
+	name_count--;
+}
+
+/*
+ * Place a mark on the file system containing path unless one exists
+ */
+static int
+fan_mark(const char *path, fsid_t *fsid) {
+	struct statfs sfs;
+	int i;
+
+	if (statfs(path, &sfs) == -1)
+		return -1;
+	*fsid = sfs.f_fsid;
+	for (i = 0; i < n_marks; i++) {
+		if (memcmp(&marks[i], fsid, sizeof(fsid_t)) == 0)
+			return 0;
+	}
+	if (n_marks == FAN_MARKS_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fan_mask, AT_FDCWD, path)
+	    == -1)
+		return -1;
+	marks[n_marks++] = *fsid;
+	return 0;
+}
+
+static int
+fan_append(struct kevent *eventlist, int n, WatchFile *file, u_int fflags) {
+	/* merge events if we're not acting on a new file */
+	if ((n > 0) && (eventlist[n - 1].filter == EVFILT_VNODE)
+	    && (eventlist[n - 1].udata == file))
+		fflags |= eventlist[--n].fflags;
+
+	eventlist[n].ident = file->fd;
+	eventlist[n].filter = EVFILT_VNODE;
+	eventlist[n].flags = 0;
+	eventlist[n].fflags = fflags;
+	eventlist[n].data = 0;
+	eventlist[n].udata = file;
+	return n + 1;
+}
+
+/* interface */
+
+int
+fan_init(void) {
+	fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE
+	        | FAN_CLOEXEC | FAN_NONBLOCK,
+	    O_RDONLY);
+	if (fanotify_fd == -1)
+		err(1, "fanotify_init");
+	if (getenv("ENTR_INOTIFY_WORKAROUND"))
+		fan_mask |= FAN_MODIFY;
+	return fanotify_fd;
+}
+
+/*
+ * Index a file by the handle of its parent directory and its name, or a
+ * directory by its own handle. Returns an identifier for the file or -1
+ */
+int
+fan_add_watch(WatchFile *file) {
+	char path[PATH_MAX];
+	struct fan_dir *dir;
+	const char *name;
+	size_t i;
+
+	pthread_mutex_lock(&fan_lock);
+	if (file->is_dir) {
+		if ((dir = fan_dir_get(file->fn)) == NULL)
+			goto fail;
+		dir->self = file;
+	} else {
+		if (snprintf(path, sizeof(path), "%s", file->fn) >= (int) sizeof(path)) {
+			errno = ENAMETOOLONG;
+			goto fail;
+		}
+		if ((dir = fan_dir_get(dirname(path))) == NULL)
+			goto fail;
+		name = strrchr(file->fn, '/') ? strrchr(file->fn, '/') + 1 : file->fn;
+
+		if ((name_count + 1) * 2 > name_size)
+			fan_name_grow();
+		i = fan_name_slot(dir, name);
+		if (name_table[i].file == NULL)
+			name_count++;
+		name_table[i].dir = dir;
+		name_table[i].name = name;
+		name_table[i].file = file;
+	}
+	file->fan_dir = dir;
+	file->fd = next_ident++;
+	pthread_mutex_unlock(&fan_lock);
+	return file->fd;
+fail:
+	pthread_mutex_unlock(&fan_lock);
+	return -1;
+}
+
+void
+fan_rm_watch(WatchFile *file) {
+	struct fan_dir *dir = file->fan_dir;
+	const char *name;
+	size_t i;
+
+	if (dir == NULL)
+		return;
+	pthread_mutex_lock(&fan_lock);
+	if (file->is_dir) {
+		if (dir->self == file)
+			dir->self = NULL;
+	} else if (name_count > 0) {
+		name = strrchr(file->fn, '/') ? strrchr(file->fn, '/') + 1 : file->fn;
+		i = fan_name_slot(dir, name);
+		if (name_table[i].file == file)
+			fan_name_remove(i);
+	}
+	file->fan_dir = NULL;
+	pthread_mutex_unlock(&fan_lock);
+}
+
+int
+fan_pending(void) {
+	return fpos < flen;
+}
+
+/*
+ * Convert queued fanotify events for files under watch until the event list
+ * is full or no more are available without blocking. Returns the new number
+ * of events
+ */
+int
+fan_read(struct kevent *eventlist, int n, int nevents) {
+	struct fanotify_event_metadata *meta;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	struct fan_dir *dir;
+	unsigned char key[FAN_KEY_MAX];
+	const char *name;
+	WatchFile *file;
+	size_t i, key_len;
+	ssize_t start;
+	u_int fflags;
+	char *p;
+
+	while (n < nevents) {
+		if (fpos >= flen) {
+			fpos = 0;
+			flen = read(fanotify_fd, fbuf, sizeof(fbuf));
+			if (flen == -1) {
+				flen = 0;
+				if ((errno == EAGAIN) || (errno == EINTR))
+					break;
+				err(1, "read of fd %d failed", fanotify_fd);
+			}
+		}
+		start = fpos;
+		meta = (struct fanotify_event_metadata *) &fbuf[fpos];
+		if (!FAN_EVENT_OK(meta, flen - fpos)) {
+			fpos = flen;
+			continue;
+		}
+		fpos += meta->event_len;
+		if (meta->vers != FANOTIFY_METADATA_VERSION)
+			errx(1, "fanotify metadata version mismatch");
+		if (meta->fd >= 0)
+			close(meta->fd);
+
+		fflags = 0;
+		if (meta->mask & FAN_CLOSE_WRITE)
+			fflags |= NOTE_WRITE;
+		if (meta->mask & FAN_MODIFY)
+			fflags |= NOTE_WRITE;
+		if (meta->mask & FAN_ATTRIB)
+			fflags |= NOTE_ATTRIB;
+		if (meta->mask & FAN_CREATE)
+			fflags |= NOTE_WRITE;
+		if (meta->mask & FAN_DELETE)
+			fflags |= NOTE_DELETE;
+		if (meta->mask & FAN_DELETE_SELF)
+			fflags |= NOTE_DELETE;
+		if (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MOVE_SELF))
+			fflags |= NOTE_RENAME;
+		if (fflags == 0)
+			continue;
+
+		/* the first record identifies the directory and possibly an entry */
+		fid = (struct fanotify_event_info_fid *) (meta + 1);
+		if ((char *) fid >= (char *) meta + meta->event_len)
+			continue;
+		if ((fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+		    && (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+		    && (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_FID))
+			continue;
+		fh = (struct file_handle *) fid->handle;
+		name = NULL;
+		if (fh->handle_bytes > MAX_HANDLE_SZ)
+			continue;
+		/* events on a directory itself are named "." */
+		if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+			name = (char *) fh->f_handle + fh->handle_bytes;
+		if ((name != NULL) && (strcmp(name, ".") == 0))
+			name = NULL;
+
+		p = (char *) key;
+		memcpy(p, &fid->fsid, sizeof(fsid_t));
+		memcpy(p + sizeof(fsid_t), &fh->handle_type, sizeof(int));
+		memcpy(p + sizeof(fsid_t) + sizeof(int), fh->f_handle, fh->handle_bytes);
+		key_len = sizeof(fsid_t) + sizeof(int) + fh->handle_bytes;
+
+		pthread_mutex_lock(&fan_lock);
+		dir = fan_dir_find(key, key_len, fan_hash(key, key_len, 14695981039346656037ULL));
+		if (dir == NULL) {
+			pthread_mutex_unlock(&fan_lock);
+			continue;
+		}
+		file = NULL;
+		if ((name != NULL) && (name_count > 0)) {
+			i = fan_name_slot(dir, name);
+			file = name_table[i].file;
+		}
+		/* keep the event for the next call if both reports do not fit */
+		if ((file != NULL) && (dir->self != NULL) && (n + 1 == nevents)) {
+			pthread_mutex_unlock(&fan_lock);
+			fpos = start;
+			break;
+		}
+		if (file != NULL)
+			n = fan_append(eventlist, n, file, fflags);
+		/* a change to a directory entry is reported as a write */
+		if (dir->self != NULL) {
+			if ((name != NULL) && (fflags & NOTE_DELETE))
+				fflags = (fflags & ~NOTE_DELETE) | NOTE_WRITE;
+			n = fan_append(eventlist, n, dir->self, fflags);
+		}
+		pthread_mutex_unlock(&fan_lock);
+	}
+	return n;
+}
@@ -1,16 +1,22 @@
 /*
  * kqueue_inotify.c
- * emulate kqueue(2) interface on Linux
+ * emulate kqueue(2) interface on Linux using epoll(7)
  */
 
+#include <sys/epoll.h>
 #include <sys/event.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <err.h>
 #include <errno.h>
+#include <libgen.h>
 #include <limits.h>
-#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,26 +27,278 @@
 
 #include "../data.h"
 
-/* globals */
+/*
+ * Each source other than inotify is backed by a descriptor registered with
+ * epoll: EVFILT_READ and EVFILT_WRITE use the descriptor supplied,
+ * EVFILT_TIMER a timerfd and EVFILT_PROC a pidfd
+ */
+
+#define SOURCES_MAX 64
+
+struct source {
+	short filter;
+	u_int ident;
+	u_short flags;
+	int fd;
+	void *udata;
+};
+
+static struct source sources[SOURCES_MAX];
+static int n_sources;
+static int inotify_fd = -1;
+static int fanotify_queue = -1;
+static int inotify_workaround; /* ENTR_INOTIFY_WORKAROUND */
+static int inotify_dirs;       /* ENTR_BACKEND=inotify-dir */
+static int follow_symlinks;    /* ENTR_FOLLOW_SYMLINK */
+
+/*
+ * inotify events are read into a buffer that grows to hold everything that
+ * is queued; events that did not fit in the caller's event list are kept
+ */
+#define IBUF_MIN (32 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define IBUF_MAX (4 * 1024 * 1024)
+
+static char *ibuf;
+static ssize_t ilen;
+static ssize_t ipos;
+
+struct inotify_stats inotify_stats;
+
+/*
+ * open addressing table mapping watch descriptors to files; inotify hands out
+ * descriptors cyclically, so the slots are hashed rather than indexed directly
+ *   wd_entry   : the file or directory watched by a descriptor. When watching
+ *                directories, names counts the entries that share it
+ *   name_entry : a file reported by name through the watch on its directory
+ */
+struct wd_entry {
+	int wd;
+	int names;
+	WatchFile *file;
+};
+
+struct name_entry {
+	int wd;
+	const char *name;
+	WatchFile *file;
+};
+
+static struct wd_entry *wd_table;
+static size_t wd_size; /* power of two */
+static size_t wd_count;
+
+static struct name_entry *name_entries;
+static size_t names_size; /* power of two */
+static size_t names_count;
 
-extern WatchFile **files;
-int read_stdin;
+/* files may be registered from more than one thread */
+static pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* forwards */
 
-static WatchFile *file_by_descriptor(int fd);
+static WatchFile *file_by_descriptor(int fd, const char *name);
+static size_t descriptor_slot(int wd);
+static size_t index_descriptor(int wd, WatchFile *file);
+static int unindex_descriptor(int wd, WatchFile *file);
+static size_t name_hash(int wd, const char *name);
+static size_t name_slot(int wd, const char *name);
+static void index_name(int wd, WatchFile *file);
+static int unindex_name(int wd, WatchFile *file);
+static int register_name(const struct kevent *kev);
+static struct source *find_source(short filter, u_int ident);
+static void remove_source(int epfd, struct source *src);
+static int add_source(int epfd, const struct kevent *kev);
+static int register_vnode(const struct kevent *kev);
+static int append_event(struct kevent *eventlist, int n, WatchFile *file, u_int fflags);
+static int read_inotify(struct kevent *eventlist, int n, int nevents);
 
 /* utility functions */
 
+#define WD_SLOT(wd) (((unsigned) (wd) * 2654435761U) & (wd_size - 1))
+#define BASENAME(fn) (strrchr((fn), '/') ? strrchr((fn), '/') + 1 : (fn))
+
+/*
+ * Look up the file watched by a descriptor, or the entry reported by name
+ * through the watch on its directory
+ */
 static WatchFile *
-file_by_descriptor(int wd) {
-	int i;
+file_by_descriptor(int wd, const char *name) {
+	if (name != NULL) {
+		if (names_count == 0)
+			return NULL;
+		return name_entries[name_slot(wd, name)].file;
+	}
+	if (wd_count == 0)
+		return NULL;
+	return wd_table[descriptor_slot(wd)].file;
+}
+
+/*
+ * Returns the slot holding the descriptor, or the empty slot where it belongs.
+ * inotify never hands out a descriptor of 0, which marks an empty slot
+ */
+static size_t
+descriptor_slot(int wd) {
+	size_t i;
+
+	for (i = WD_SLOT(wd); wd_table[i].wd != 0; i = (i + 1) & (wd_size - 1)) {
+		if (wd_table[i].wd == wd)
+			break;
+	}
+	return i;
+}
+
+/*
+ * Record the file watched by a descriptor, or only reserve the descriptor if
+ * file is NULL. Returns the slot
+ */
+static size_t
+index_descriptor(int wd, WatchFile *file) {
+	size_t i, old_size;
+	struct wd_entry *old_table;
+
+	/* keep the load factor under 1/2 */
+	if ((wd_count + 1) * 2 > wd_size) {
+		old_table = wd_table;
+		old_size = wd_size;
+		wd_size = wd_size ? wd_size * 2 : 1024;
+		wd_table = calloc(wd_size, sizeof(*wd_table));
+		if (wd_table == NULL)
+			err(1, "calloc");
+		for (i = 0; i < old_size; i++) {
+			if (old_table[i].wd != 0)
+				wd_table[descriptor_slot(old_table[i].wd)] = old_table[i];
+		}
+		free(old_table);
+	}
+
+	/* the same inode may be reached through more than one path */
+	i = descriptor_slot(wd);
+	if (wd_table[i].wd == 0) {
+		wd_table[i].wd = wd;
+		wd_count++;
+		inotify_stats.watches = wd_count;
+	}
+	if (file != NULL)
+		wd_table[i].file = file;
+	return i;
+}
+
+/*
+ * Release the file watched by a descriptor, or one of the entries sharing it
+ * if file is NULL. Returns 1 if the descriptor is no longer in use
+ */
+static int
+unindex_descriptor(int wd, WatchFile *file) {
+	size_t i, j, k;
+
+	if (wd_count == 0)
+		return 0;
+	i = descriptor_slot(wd);
+	if (wd_table[i].wd == 0)
+		return 0;
+	if (file == NULL)
+		wd_table[i].names--;
+	else if (wd_table[i].file == file)
+		wd_table[i].file = NULL;
+	else
+		return 0;
+	if ((wd_table[i].file != NULL) || (wd_table[i].names > 0))
+		return 0;
+
+	/* backward shift deletion so that probe sequences remain intact */
+	for (j = (i + 1) & (wd_size - 1); wd_table[j].wd != 0; j = (j + 1) & (wd_size - 1)) {
+		k = WD_SLOT(wd_table[j].wd);
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		wd_table[i] = wd_table[j];
+		i = j;
+	}
+	wd_table[i].wd = 0;
+	wd_table[i].file = NULL;
+	wd_count--;
+	inotify_stats.watches = wd_count;
+	return 1;
+}
+
+static size_t
+name_hash(int wd, const char *name) {
+	size_t h = (unsigned) wd * 2654435761U;
+
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 1099511628211ULL;
+	return h;
+}
+
+/*
+ * Returns the slot holding the entry, or the empty slot where it belongs
+ */
+static size_t
+name_slot(int wd, const char *name) {
+	size_t i;
+
+	for (i = name_hash(wd, name) & (names_size - 1); name_entries[i].file != NULL;
+	    i = (i + 1) & (names_size - 1)) {
+		if ((name_entries[i].wd == wd) && (strcmp(name_entries[i].name, name) == 0))
+			break;
+	}
+	return i;
+}
 
-	for (i = 0; files[i] != NULL; i++) {
-		if (files[i]->fd == wd)
-			return files[i];
+static void
+index_name(int wd, WatchFile *file) {
+	struct name_entry *old_table;
+	const char *name = BASENAME(file->fn);
+	size_t i, j, old_size;
+
+	if ((names_count + 1) * 2 > names_size) {
+		old_table = name_entries;
+		old_size = names_size;
+		names_size = names_size ? names_size * 2 : 1024;
+		if ((name_entries = calloc(names_size, sizeof(*name_entries))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < old_size; i++) {
+			if (old_table[i].file != NULL)
+				name_entries[name_slot(old_table[i].wd, old_table[i].name)] =
+				    old_table[i];
+		}
+		free(old_table);
 	}
-	return NULL; /* lookup failed */
+
+	i = name_slot(wd, name);
+	if (name_entries[i].file == NULL) {
+		j = index_descriptor(wd, NULL);
+		wd_table[j].names++;
+		names_count++;
+	}
+	name_entries[i].wd = wd;
+	name_entries[i].name = name;
+	name_entries[i].file = file;
+}
+
+/*
+ * Returns 1 if the watch on the directory is no longer in use
+ */
+static int
+unindex_name(int wd, WatchFile *file) {
+	size_t i, j, k;
+
+	i = name_slot(wd, BASENAME(file->fn));
+	if (name_entries[i].file != file)
+		return 0;
+
+	/* backward shift deletion so that probe sequences remain intact */
+	for (j = (i + 1) & (names_size - 1); name_entries[j].file != NULL;
+	    j = (j + 1) & (names_size - 1)) {
+		k = name_hash(name_entries[j].wd, name_entries[j].name) & (names_size - 1);
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		name_entries[i] = name_entries[j];
+		i = j;
+	}
+	name_entries[i].file = NULL;
+	names_count--;
+	return unindex_descriptor(wd, NULL);
 }
 
 int
@@ -66,176 +324,458 @@ fs_sysctl(const int name) {
 	return value;
 }
 
+/*
+ * Parse ENTR_BACKEND once
+ */
+int
+select_backend(void) {
+	static int backend = -1;
+	const char *name;
+
+	if (backend != -1)
+		return backend;
+	name = getenv("ENTR_BACKEND");
+	if ((name == NULL) || (strcmp(name, "inotify") == 0))
+		backend = BACKEND_INOTIFY;
+	else if (strcmp(name, "inotify-dir") == 0)
+		backend = BACKEND_INOTIFY_DIR;
+	else if (strcmp(name, "fanotify") == 0)
+		backend = BACKEND_FANOTIFY;
+	else
+		errx(1, "unknown backend: %s", name);
+	return backend;
+}
+
 /* interface */
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
-#define EVENT_BUF_LEN (32 * (EVENT_SIZE + 16))
 #define IN_ALL                                                                                     \
 	IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVE | IN_ATTRIB | IN_CREATE | IN_DELETE
 
 /*
- * inotify and kqueue ids both have the type `int`
+ * Create an epoll instance with an inotify or fanotify descriptor attached.
+ * Returns the epoll descriptor
  */
 int
 kqueue(void) {
-	static int inotify_queue;
+	static int epoll_queue = -1;
+	struct epoll_event ev;
 
-	if (inotify_queue == 0)
-		inotify_queue = inotify_init1(IN_CLOEXEC);
-	if (getenv("ENTR_INOTIFY_WORKAROUND"))
+	if (epoll_queue != -1)
+		return epoll_queue;
+	if ((epoll_queue = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return -1;
+	ev.events = EPOLLIN;
+	if (select_backend() == BACKEND_FANOTIFY) {
+		fanotify_queue = fan_init();
+		ev.data.fd = fanotify_queue;
+		if (epoll_ctl(epoll_queue, EPOLL_CTL_ADD, fanotify_queue, &ev) == -1)
+			return -1;
+	} else {
+		if ((inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1)
+			return -1;
+		if ((ibuf = malloc(IBUF_MIN)) == NULL)
+			return -1;
+		inotify_stats.buf_size = IBUF_MIN;
+		inotify_dirs = select_backend() == BACKEND_INOTIFY_DIR;
+		follow_symlinks = getenv("ENTR_FOLLOW_SYMLINK") != NULL;
+		ev.data.fd = inotify_fd;
+		if (epoll_ctl(epoll_queue, EPOLL_CTL_ADD, inotify_fd, &ev) == -1)
+			return -1;
+	}
+
+	inotify_workaround = getenv("ENTR_INOTIFY_WORKAROUND") != NULL;
+	if (inotify_workaround)
 		warnx("broken inotify workaround enabled");
 	else if (getenv("ENTR_INOTIFY_SYMLINK"))
 		warnx("monitoring symlinks");
-	return inotify_queue;
+	return epoll_queue;
+}
+
+static struct source *
+find_source(short filter, u_int ident) {
+	int i;
+
+	for (i = 0; i < n_sources; i++) {
+		if ((sources[i].filter == filter) && (sources[i].ident == ident))
+			return &sources[i];
+	}
+	return NULL;
+}
+
+static void
+remove_source(int epfd, struct source *src) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	if ((src->filter != EVFILT_READ) && (src->filter != EVFILT_WRITE))
+		close(src->fd);
+	*src = sources[--n_sources];
+}
+
+/*
+ * EVFILT_READ, EVFILT_WRITE, EVFILT_TIMER (data is in milliseconds) and
+ * EVFILT_PROC with NOTE_EXIT. Adding an existing event modifies it
+ */
+static int
+add_source(int epfd, const struct kevent *kev) {
+	struct source *src;
+	struct epoll_event ev;
+	struct itimerspec its;
+	int fd;
+
+	if ((src = find_source(kev->filter, kev->ident)) != NULL) {
+		if (kev->filter != EVFILT_TIMER)
+			return 0;
+		fd = src->fd;
+	} else {
+		if (n_sources == SOURCES_MAX) {
+			errno = ENOMEM;
+			return -1;
+		}
+		switch (kev->filter) {
+		case EVFILT_READ:
+		case EVFILT_WRITE:
+			fd = kev->ident;
+			break;
+		case EVFILT_TIMER:
+			fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+			break;
+		case EVFILT_PROC:
+			fd = syscall(SYS_pidfd_open, kev->ident, 0);
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+		if (fd == -1)
+			return -1;
+		ev.events = (kev->filter == EVFILT_WRITE) ? EPOLLOUT : EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			if ((kev->filter != EVFILT_READ) && (kev->filter != EVFILT_WRITE))
+				close(fd);
+			return -1;
+		}
+		src = &sources[n_sources++];
+		src->filter = kev->filter;
+		src->ident = kev->ident;
+		src->fd = fd;
+	}
+	src->flags = kev->flags;
+	src->udata = kev->udata;
+
+	if (kev->filter == EVFILT_TIMER) {
+		its.it_value.tv_sec = kev->data / 1000;
+		its.it_value.tv_nsec = (kev->data % 1000) * 1000000;
+		if ((its.it_value.tv_sec == 0) && (its.it_value.tv_nsec == 0))
+			its.it_value.tv_nsec = 1; /* zero would disarm the timer */
+		if (kev->flags & EV_ONESHOT)
+			its.it_interval.tv_sec = its.it_interval.tv_nsec = 0;
+		else
+			its.it_interval = its.it_value;
+		if (timerfd_settime(fd, 0, &its, NULL) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+register_vnode(const struct kevent *kev) {
+	WatchFile *file = (WatchFile *) kev->udata;
+	int wd;
+
+	if (fanotify_queue != -1) {
+		if (kev->flags & EV_DELETE) {
+			fan_rm_watch(file);
+			file->fd = -1; /* invalidate */
+		} else if (kev->flags & EV_ADD) {
+			close(file->fd);
+			if (fan_add_watch(file) == -1)
+				return -1;
+		}
+		return 0;
+	}
+	if (inotify_dirs)
+		return register_name(kev);
+	if (kev->flags & EV_DELETE) {
+		inotify_rm_watch(inotify_fd, kev->ident);
+		pthread_mutex_lock(&wd_lock);
+		unindex_descriptor(kev->ident, file);
+		pthread_mutex_unlock(&wd_lock);
+		file->fd = -1; /* invalidate */
+	} else if (kev->flags & EV_ADD) {
+		if (inotify_workaround)
+			wd = inotify_add_watch(inotify_fd, file->fn, IN_ALL | IN_MODIFY);
+		else if (file->is_symlink)
+			wd = inotify_add_watch(inotify_fd, file->fn, IN_ALL | IN_DONT_FOLLOW);
+		else
+			wd = inotify_add_watch(inotify_fd, file->fn, IN_ALL);
+		if (wd < 0)
+			return -1;
+		close(file->fd);
+		file->fd = wd; /* replace with watch descriptor */
+		pthread_mutex_lock(&wd_lock);
+		index_descriptor(wd, file);
+		pthread_mutex_unlock(&wd_lock);
+	}
+	return 0;
 }
 
 /*
- * Emulate kqueue(2). Only monitors STDIN for EVFILT_READ and only the
- * EVFILT_VNODE flags used in entr.c are considered. Returns the number of
+ * Watch the directory containing a file and index the file by name. A
+ * directory, or a symlink that is followed, is watched itself
+ */
+static int
+register_name(const struct kevent *kev) {
+	WatchFile *file = (WatchFile *) kev->udata;
+	char path[PATH_MAX];
+	struct stat sb;
+	uint32_t mask = IN_ALL;
+	int wd, by_name, unused;
+
+	if (kev->flags & EV_DELETE) {
+		pthread_mutex_lock(&wd_lock);
+		if (file_by_descriptor(kev->ident, BASENAME(file->fn)) == file)
+			unused = unindex_name(kev->ident, file);
+		else
+			unused = unindex_descriptor(kev->ident, file);
+		pthread_mutex_unlock(&wd_lock);
+		if (unused)
+			inotify_rm_watch(inotify_fd, kev->ident);
+		file->fd = -1; /* invalidate */
+		return 0;
+	}
+	if ((kev->flags & EV_ADD) == 0)
+		return 0;
+
+	if (inotify_workaround)
+		mask |= IN_MODIFY;
+	/* changes to the target of a symlink are not reported to its directory */
+	by_name = !file->is_dir
+	    && !(follow_symlinks && (lstat(file->fn, &sb) == 0) && S_ISLNK(sb.st_mode));
+	if (by_name) {
+		if (snprintf(path, sizeof(path), "%s", file->fn) >= (int) sizeof(path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		wd = inotify_add_watch(inotify_fd, dirname(path), mask | IN_ONLYDIR);
+	} else
+		wd = inotify_add_watch(inotify_fd, file->fn, mask);
+	if (wd < 0)
+		return -1;
+	close(file->fd);
+	file->fd = wd; /* shared by the entries in a directory */
+	pthread_mutex_lock(&wd_lock);
+	if (by_name)
+		index_name(wd, file);
+	else
+		index_descriptor(wd, file);
+	pthread_mutex_unlock(&wd_lock);
+	return 0;
+}
+
+static int
+append_event(struct kevent *eventlist, int n, WatchFile *file, u_int fflags) {
+	/* merge events if we're not acting on a new file */
+	if ((n > 0) && (eventlist[n - 1].filter == EVFILT_VNODE)
+	    && (eventlist[n - 1].udata == file))
+		fflags |= eventlist[--n].fflags;
+
+	eventlist[n].ident = file->fd;
+	eventlist[n].filter = EVFILT_VNODE;
+	eventlist[n].flags = 0;
+	eventlist[n].fflags = fflags;
+	eventlist[n].data = 0;
+	eventlist[n].udata = file;
+	return n + 1;
+}
+
+/*
+ * Convert queued inotify events until the event list is full or no more are
+ * available without blocking. Returns the new number of events
+ */
+static int
+read_inotify(struct kevent *eventlist, int n, int nevents) {
+	struct inotify_event *iev;
+	WatchFile *file, *entry;
+	struct stat sb;
+	u_int fflags;
+	int queued;
+	size_t size;
+	char *p;
+
+	while (n < nevents) {
+		if (ipos >= ilen) {
+			if ((ioctl(inotify_fd, FIONREAD, &queued) == 0)
+			    && ((size_t) queued > inotify_stats.buf_size)
+			    && (inotify_stats.buf_size < IBUF_MAX)) {
+				size = inotify_stats.buf_size ? inotify_stats.buf_size : IBUF_MIN;
+				while ((size < (size_t) queued) && (size < IBUF_MAX))
+					size *= 2;
+				if ((p = realloc(ibuf, size)) == NULL)
+					err(1, "realloc");
+				ibuf = p;
+				inotify_stats.buf_size = size;
+			}
+			ipos = 0;
+			ilen = read(inotify_fd, ibuf, inotify_stats.buf_size);
+			if (ilen == -1) {
+				ilen = 0;
+				/* SA_RESTART doesn't work for inotify fds */
+				if ((errno == EAGAIN) || (errno == EINTR))
+					break;
+				errx(1, "read of fd %d failed", inotify_fd);
+			}
+			inotify_stats.reads++;
+			inotify_stats.bytes += ilen;
+		}
+		iev = (struct inotify_event *) &ibuf[ipos];
+		ipos += EVENT_SIZE + iev->len;
+
+		/* convert iev->mask; to comparable kqueue flags */
+		fflags = 0;
+		if (iev->mask & IN_DELETE_SELF)
+			fflags |= NOTE_DELETE;
+		if (iev->mask & IN_CLOSE_WRITE)
+			fflags |= NOTE_WRITE;
+		if (iev->mask & IN_CREATE)
+			fflags |= NOTE_WRITE;
+		if (iev->mask & IN_DELETE)
+			fflags |= NOTE_WRITE;
+		if (iev->mask & IN_MOVE_SELF)
+			fflags |= NOTE_RENAME;
+		if (iev->mask & IN_MOVED_TO)
+			fflags |= NOTE_RENAME;
+		if (iev->mask & IN_MOVED_FROM)
+			fflags |= NOTE_RENAME;
+		if (iev->mask & IN_ATTRIB)
+			fflags |= NOTE_ATTRIB;
+		if (inotify_workaround)
+			if (iev->mask & IN_MODIFY)
+				fflags |= NOTE_WRITE;
+		if (fflags == 0)
+			continue;
+		file = file_by_descriptor(iev->wd, NULL);
+		entry = NULL;
+		if (inotify_dirs && (iev->len > 0))
+			entry = file_by_descriptor(iev->wd, iev->name);
+		if ((file == NULL) && (entry == NULL))
+			continue;
+
+		/* keep the event for the next call if both reports do not fit */
+		if ((file != NULL) && (entry != NULL) && (n + 1 == nevents)) {
+			ipos -= EVENT_SIZE + iev->len;
+			break;
+		}
+		if (entry != NULL)
+			n = append_event(eventlist, n, entry,
+			    (iev->mask & IN_DELETE) ? NOTE_DELETE : fflags);
+		if (file == NULL)
+			continue;
+
+		/*
+		 * IN_DELETE_SELF is not sent until an inode is released, so a
+		 * file that is unlinked while open elsewhere (such as a running
+		 * executable) only reports a change of link count
+		 */
+		if ((fflags & NOTE_ATTRIB) && (lstat(file->fn, &sb) == -1) && (errno == ENOENT))
+			fflags |= NOTE_DELETE;
+
+		n = append_event(eventlist, n, file, fflags);
+	}
+	return n;
+}
+
+/*
+ * Emulate kqueue(2). Supports EVFILT_READ, EVFILT_WRITE, EVFILT_TIMER,
+ * EVFILT_PROC and the EVFILT_VNODE flags used in entr.c. Returns the number of
  * eventlist structs filled by this call
  */
 int
 kevent(int kq, const struct kevent *changelist, int nchanges, struct kevent *eventlist, int nevents,
     const struct timespec *timeout) {
-	int n;
-	int wd;
-	WatchFile *file;
-	char buf[EVENT_BUF_LEN];
-	ssize_t len;
-	int pos;
-	struct inotify_event *iev;
-	u_int fflags;
+	struct epoll_event ev[SOURCES_MAX + 1];
+	struct source *src;
 	const struct kevent *kev;
-	int nfds;
-
+	uint64_t expirations;
 	int timeout_ms = -1;
 	int ignored = 0;
-	struct pollfd pfd[2];
-
-	pfd[0].fd = kq;
-	pfd[0].events = POLLIN;
-	pfd[0].revents = 0;
-	pfd[1].fd = STDIN_FILENO;
-	pfd[1].events = POLLIN;
-	pfd[1].revents = 0;
+	int i, n, nfds;
 
 	if (nchanges > 0) {
 		for (n = 0; n < nchanges; n++) {
-			kev = changelist + (sizeof(struct kevent) * n);
-			file = (WatchFile *) kev->udata;
-
-			if (kev->filter == EVFILT_READ) {
-				if (kev->flags & EV_ADD)
-					read_stdin = 1;
-				if (kev->flags & EV_DELETE)
-					read_stdin = 0;
-			}
-
-			if (kev->filter != EVFILT_VNODE)
-				continue;
+			kev = &changelist[n];
 
-			if (kev->flags & EV_DELETE) {
-				inotify_rm_watch(kq /* ifd */, kev->ident);
-				file->fd = -1; /* invalidate */
+			if (kev->filter == EVFILT_VNODE) {
+				if ((kev->flags & (EV_ADD | EV_DELETE)) == 0)
+					ignored++;
+				else if (register_vnode(kev) == -1)
+					return -1;
+			} else if (kev->flags & EV_DELETE) {
+				if ((src = find_source(kev->filter, kev->ident)) != NULL)
+					remove_source(kq, src);
 			} else if (kev->flags & EV_ADD) {
-				if (getenv("ENTR_INOTIFY_WORKAROUND"))
-					wd = inotify_add_watch(kq, file->fn, IN_ALL | IN_MODIFY);
-				else if (file->is_symlink)
-					wd = inotify_add_watch(kq, file->fn, IN_ALL | IN_DONT_FOLLOW);
-				else
-					wd = inotify_add_watch(kq, file->fn, IN_ALL);
-				if (wd < 0)
+				if (add_source(kq, kev) == -1)
 					return -1;
-				close(file->fd);
-				file->fd = wd; /* replace with watch descriptor */
 			} else
 				ignored++;
 		}
 		return nchanges - ignored;
 	}
 
-	if (read_stdin == 1)
-		nfds = 2; /* inotify and stdin */
-	else
-		nfds = 1; /* inotify */
+	/* events left over from a previous call are returned first */
+	if ((ipos < ilen) || ((fanotify_queue != -1) && fan_pending()))
+		timeout_ms = 0;
+	else if (timeout)
+		timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
 
-	if (timeout)
-		timeout_ms = timeout->tv_nsec / 1000000;
-	if (poll(pfd, nfds, timeout_ms) == -1)
+	nfds = epoll_wait(kq, ev, SOURCES_MAX + 1, timeout_ms);
+	if (nfds == -1)
 		return -1;
 
 	n = 0;
-	do {
-		if (pfd[0].revents & (POLLERR | POLLNVAL))
-			errx(1, "bad fd %d", pfd[0].fd);
-		if (pfd[0].revents & POLLIN) {
-			pos = 0;
-			len = read(kq /* ifd */, &buf, EVENT_BUF_LEN);
-			if (len < 0) {
-				/* SA_RESTART doesn't work for inotify fds */
-				if (errno == EINTR)
-					continue;
-				else
-					errx(1, "read of fd %d failed", pfd[0].fd);
-			}
-			while ((pos < len) && (n < nevents)) {
-				iev = (struct inotify_event *) &buf[pos];
-				pos += EVENT_SIZE + iev->len;
-
-				/* convert iev->mask; to comparable kqueue flags */
-				fflags = 0;
-				if (iev->mask & IN_DELETE_SELF)
-					fflags |= NOTE_DELETE;
-				if (iev->mask & IN_CLOSE_WRITE)
-					fflags |= NOTE_WRITE;
-				if (iev->mask & IN_CREATE)
-					fflags |= NOTE_WRITE;
-				if (iev->mask & IN_DELETE)
-					fflags |= NOTE_WRITE;
-				if (iev->mask & IN_MOVE_SELF)
-					fflags |= NOTE_RENAME;
-				if (iev->mask & IN_MOVED_TO)
-					fflags |= NOTE_RENAME;
-				if (iev->mask & IN_MOVED_FROM)
-					fflags |= NOTE_RENAME;
-				if (iev->mask & IN_ATTRIB)
-					fflags |= NOTE_ATTRIB;
-				if (getenv("ENTR_INOTIFY_WORKAROUND"))
-					if (iev->mask & IN_MODIFY)
-						fflags |= NOTE_WRITE;
-				if (fflags == 0)
-					continue;
-
-				/* merge events if we're not acting on a new file descriptor */
-				if ((n > 0) && (eventlist[n - 1].ident == iev->wd))
-					fflags |= eventlist[--n].fflags;
-
-				eventlist[n].ident = iev->wd;
-				eventlist[n].filter = EVFILT_VNODE;
-				eventlist[n].flags = 0;
-				eventlist[n].fflags = fflags;
-				eventlist[n].data = 0;
-				eventlist[n].udata = file_by_descriptor(iev->wd);
-				if (eventlist[n].udata)
-					n++;
-			}
+	if (ipos < ilen)
+		n = read_inotify(eventlist, n, nevents);
+	else if ((fanotify_queue != -1) && fan_pending())
+		n = fan_read(eventlist, n, nevents);
+	for (i = 0; (i < nfds) && (n < nevents); i++) {
+		if (ev[i].data.fd == inotify_fd) {
+			n = read_inotify(eventlist, n, nevents);
+			continue;
+		}
+		if (ev[i].data.fd == fanotify_queue) {
+			n = fan_read(eventlist, n, nevents);
+			continue;
 		}
-		if (read_stdin == 1) {
-			if (pfd[1].revents & (POLLERR | POLLNVAL))
-				errx(1, "bad fd %d", pfd[1].fd);
-			else if (pfd[1].revents & (POLLHUP | POLLIN)) {
-				fflags = 0;
-				eventlist[n].ident = pfd[1].fd;
-				eventlist[n].filter = EVFILT_READ;
-				eventlist[n].flags = 0;
-				eventlist[n].fflags = fflags;
-				eventlist[n].data = 0;
-				eventlist[n].udata = NULL;
-				n++;
+		for (src = sources; src < sources + n_sources; src++) {
+			if (src->fd == ev[i].data.fd)
 				break;
-			}
 		}
-	} while ((poll(pfd, nfds, 50) > 0));
-
+		if (src == sources + n_sources)
+			continue; /* removed while processing this list */
+
+		eventlist[n].ident = src->ident;
+		eventlist[n].filter = src->filter;
+		eventlist[n].flags = 0;
+		eventlist[n].fflags = 0;
+		eventlist[n].data = 0;
+		eventlist[n].udata = src->udata;
+
+		switch (src->filter) {
+		case EVFILT_TIMER:
+			if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+				continue; /* rearmed since epoll_wait() returned */
+			eventlist[n].data = expirations;
+			if (src->flags & EV_ONESHOT)
+				remove_source(kq, src);
+			break;
+		case EVFILT_PROC:
+			/* the caller reaps the process using waitpid(2) */
+			eventlist[n].flags = EV_EOF;
+			eventlist[n].fflags = NOTE_EXIT;
+			remove_source(kq, src);
+			break;
+		}
+		n++;
+	}
 	return n;
 }
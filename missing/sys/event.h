@@ -7,7 +7,10 @@
 #include <sys/time.h>
 
 #define EVFILT_READ		(-1)
+#define EVFILT_WRITE		(-2)
 #define EVFILT_VNODE		(-4)	/* attached to vnodes */
+#define EVFILT_PROC		(-5)	/* attached to struct process */
+#define EVFILT_TIMER		(-7)	/* timers */
 
 /* actions */
 #define EV_ADD		0x0001		/* add event to kq (implies enable) */
@@ -19,6 +22,9 @@
 #define EV_ONESHOT	0x0010		/* only report one occurrence */
 #define EV_CLEAR	0x0020		/* clear event state after reporting */
 
+/* returned values */
+#define EV_EOF		0x8000		/* EOF detected */
+
 /*
  * data/hint flags for EVFILT_{READ|WRITE}, shared with userspace
  */
@@ -36,6 +42,11 @@
 #define	NOTE_REVOKE	0x0040			/* vnode access was revoked */
 #define	NOTE_TRUNCATE   0x0080			/* vnode was truncated */
 
+/*
+ * data/hint flags for EVFILT_PROC, shared with userspace
+ */
+#define	NOTE_EXIT	0x80000000		/* process exited */
+
 #define EV_SET(kevp, a, b, c, d, e, f) do {	\
 	(kevp)->ident = (a);			\
 	(kevp)->filter = (b);			\
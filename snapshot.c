@@ -0,0 +1,138 @@
+/*
+ * snapshot.c
+ * sorted listings of directory entries
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* forwards */
+
+static int compare_entry(const void *, const void *);
+
+/* name buffer used by compare_entry() while sorting */
+static const char *sort_names;
+
+/*
+ * Entries are ordered by a hash of the name so that two listings can be
+ * compared in a single pass; names are only compared if the hashes match
+ */
+static int
+compare_entry(const void *a, const void *b) {
+	const struct snapshot_entry *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return (x->hash < y->hash) ? -1 : 1;
+	return strcmp(sort_names + x->name, sort_names + y->name);
+}
+
+/*
+ * List a directory, skipping names that begin with '.' unless all is set.
+ * Returns NULL if the directory cannot be read
+ */
+Snapshot *
+snapshot_take(const char *path, int all) {
+	Snapshot *s;
+	DIR *dfd;
+	struct dirent *dp;
+	const unsigned char *p;
+	size_t len, names_len = 0, names_size = 0;
+	int size = 0;
+	uint64_t h;
+	void *q;
+
+	if ((dfd = opendir(path)) == NULL)
+		return NULL;
+	if ((s = calloc(1, sizeof(Snapshot))) == NULL)
+		err(1, "calloc");
+	while ((dp = readdir(dfd)) != NULL) {
+		if ((strcmp(dp->d_name, ".") == 0) || (strcmp(dp->d_name, "..") == 0))
+			continue;
+		if (!all && (dp->d_name[0] == '.'))
+			continue;
+
+		len = strlen(dp->d_name) + 1;
+		if (s->count == size) {
+			size = size ? size * 2 : 64;
+			if ((q = realloc(s->entry, size * sizeof(struct snapshot_entry))) == NULL)
+				err(1, "realloc");
+			s->entry = q;
+		}
+		while (names_len + len > names_size) {
+			names_size = names_size ? names_size * 2 : 1024;
+			if ((q = realloc(s->names, names_size)) == NULL)
+				err(1, "realloc");
+			s->names = q;
+		}
+		h = FNV_OFFSET;
+		for (p = (const unsigned char *) dp->d_name; *p; p++)
+			h = (h ^ *p) * FNV_PRIME;
+		memcpy(s->names + names_len, dp->d_name, len);
+		s->entry[s->count].hash = h;
+		s->entry[s->count].name = names_len;
+		s->count++;
+		names_len += len;
+	}
+	closedir(dfd);
+
+	sort_names = s->names;
+	qsort(s->entry, s->count, sizeof(struct snapshot_entry), compare_entry);
+	return s;
+}
+
+/*
+ * Compare two listings of the same directory, calling report (if not NULL)
+ * with each name that was added or removed. Returns the number of differences
+ */
+int
+snapshot_diff(const Snapshot *old, const Snapshot *new,
+    void (*report)(const char *, int, void *), void *arg) {
+	const struct snapshot_entry *a, *b;
+	int i = 0, j = 0, cmp, changes = 0;
+
+	while ((i < old->count) || (j < new->count)) {
+		a = (i < old->count) ? &old->entry[i] : NULL;
+		b = (j < new->count) ? &new->entry[j] : NULL;
+		if (a == NULL)
+			cmp = 1;
+		else if (b == NULL)
+			cmp = -1;
+		else if (a->hash != b->hash)
+			cmp = (a->hash < b->hash) ? -1 : 1;
+		else
+			cmp = strcmp(old->names + a->name, new->names + b->name);
+
+		if (cmp < 0) {
+			if (report)
+				report(old->names + a->name, 0, arg);
+			i++;
+			changes++;
+		} else if (cmp > 0) {
+			if (report)
+				report(new->names + b->name, 1, arg);
+			j++;
+			changes++;
+		} else {
+			i++;
+			j++;
+		}
+	}
+	return changes;
+}
+
+void
+snapshot_free(Snapshot *s) {
+	if (s == NULL)
+		return;
+	free(s->entry);
+	free(s->names);
+	free(s);
+}
@@ -0,0 +1,20 @@
+/*
+ * snapshot.h
+ * sorted listings of directory entries
+ */
+
+struct snapshot_entry {
+	uint64_t hash;
+	size_t name; /* offset into the name buffer */
+};
+
+typedef struct snapshot {
+	struct snapshot_entry *entry;
+	int count;
+	char *names;
+} Snapshot;
+
+Snapshot *snapshot_take(const char *, int);
+int snapshot_diff(const Snapshot *, const Snapshot *, void (*)(const char *, int, void *),
+    void *);
+void snapshot_free(Snapshot *);
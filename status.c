@@ -39,8 +39,13 @@ start_log_filter(int safe) {
 	create_dir(dirname(awk_script_path));
 	install_file(awk_script,
 	    "# http://eradman.com/entrproject/status-filters.html\n"
-	    "/^signal/ { print $3, \"terminated by signal\", $2; }\n"
-	    "/^exit/ { print $3, \"returned exit code\", $2; }\n");
+	    "function usage() {\n"
+	    "  return sprintf(\"in %.2fs (%.2fs user, %.2fs sys, %d KiB max rss, "
+	    "%d+%d context switches)\",\n"
+	    "    $4 / 1000, $5 / 1000, $6 / 1000, $7, $8, $9)\n"
+	    "}\n"
+	    "/^signal/ { print $3, \"terminated by signal\", $2, usage(); }\n"
+	    "/^exit/ { print $3, \"returned exit code\", $2, usage(); }\n");
 
 	argv[0] = "/usr/bin/awk";
 	argv[1] = "-F";
@@ -0,0 +1,221 @@
+#!/bin/sh -u
+
+trap '' ERR 2> /dev/null || exec bash $0 "$@"
+
+# benchmark runner; results are written as JSON lines
+#
+# BENCH_SIZES      : number of files in each generated tree
+# BENCH_BACKENDS   : event backends to measure, by default all that are usable
+# BENCH_ITERATIONS : writes timed for each latency measurement
+# BENCH_IDLE       : seconds to sample CPU use while idle
+
+function report { printf '{"bench":"%s","backend":"%s",%s}\n' "$1" "$backend" "$2"; }
+function now_us { eval "$clock"; }
+function ms { echo "$1" | awk '{ printf "%.2f", $1 / 1000 }'; }
+
+# percentiles of a list of numbers, one per line
+function percentiles {
+	sort -n | awk '{ v[NR] = $1 }
+	    END { printf "\"p50_ms\":%.2f,\"p90_ms\":%.2f,\"p99_ms\":%.2f,\"max_ms\":%.2f",
+	        v[int(NR * 0.5 + 0.5)] / 1000, v[int(NR * 0.9 + 0.5)] / 1000,
+	        v[int(NR * 0.99 + 0.5)] / 1000, v[NR] / 1000 }'
+}
+
+tmp=$(cd $(mktemp -d ${TMPDIR:-/tmp}/entr-system-bench-XXXXXX); pwd -P)
+trap "rm -rf $tmp" EXIT
+trap 'printf "\nTerminated by SIGINT at line $LINENO\n"; exit 1' INT
+
+sizes=${BENCH_SIZES:-1000 100000 1000000}
+iterations=${BENCH_ITERATIONS:-30}
+idle=${BENCH_IDLE:-2}
+hz=$(getconf CLK_TCK)
+
+# time in microseconds; date(1) on BSD and macOS does not support %N
+if date +%N | grep -q '^[0-9]'; then
+	clock='echo $(( $(date +%s%N) / 1000 ))'
+else
+	clock='perl -MTime::HiRes=time -e "printf(\"%d\n\", time * 1000000)"'
+fi
+
+case $(uname) in
+	Linux)
+		backends="inotify inotify-dir"
+		echo $tmp | ENTR_BACKEND=fanotify ./entr -nz true 2> /dev/null \
+		    && backends="$backends fanotify"
+		;;
+	*) backends="kqueue" ;;
+esac
+backends="$backends poll"
+backends=${BENCH_BACKENDS:-$backends}
+
+# polling is selected using ENTR_POLL rather than ENTR_BACKEND
+
+function backend_env {
+	case $backend in
+		poll) echo "ENTR_POLL=all" ;;
+		*) echo "ENTR_BACKEND=$backend" ;;
+	esac
+}
+
+# each run of the utility appends a timestamp; the first argument is the
+# list of files to watch. Trace records are written to $tmp/trace
+
+function start_entr {
+	local list=$1; shift
+	: > $tmp/runs
+	env $(backend_env) ENTR_TRACE_FD=3 ./entr -n "$@" \
+	    sh -c "$clock >> $tmp/runs" \
+	    < $list 2> $tmp/entr.err 3> $tmp/trace &
+	bgpid=$!
+}
+
+function stop_entr {
+	kill -INT $bgpid 2> /dev/null
+	wait $bgpid 2> /dev/null
+}
+
+function runs { wc -l < $tmp/runs | tr -d ' '; }
+
+# wait for a number of runs; fails if entr exits or after 120 seconds
+function wait_runs {
+	local deadline=$(( $(now_us) + 120000000 ))
+	while [ $(runs) -lt $1 ]; do
+		kill -0 $bgpid 2> /dev/null || return 1
+		[ $(now_us) -gt $deadline ] && return 1
+		sleep 0.001
+	done
+}
+
+function rss_kb { ps -o rss= -p $bgpid | tr -d ' '; }
+
+# watches and marks held by the Linux backends
+function watches {
+	if [ -d /proc/$bgpid/fdinfo ]; then
+		cat /proc/$bgpid/fdinfo/* 2> /dev/null | grep -c '^inotify wd:\|^fanotify '
+	else
+		echo 0
+	fi
+}
+
+# user and system time consumed by entr in milliseconds
+function cpu_ms {
+	if [ -r /proc/$bgpid/stat ]; then
+		awk -v hz=$hz '{ sub(/.*\) /, ""); print ($12 + $13) * 1000 / hz }' /proc/$bgpid/stat
+	else
+		ps -o time= -p $bgpid | awk -F: '{ print ($(NF-1) * 60 + $NF) * 1000 }'
+	fi
+}
+
+# trees contain directories of up to 1000 files
+
+function make_tree {
+	tree=$tmp/tree$1
+	[ -d $tree ] && return
+	mkdir $tree
+	(cd $tree && seq 0 $(( ($1 - 1) / 1000 )) | sed 's/^/d/' | xargs mkdir)
+	(cd $tree && awk -v n=$1 'BEGIN { for (i = 0; i < n; i++)
+	    printf "d%d/f%d\n", i / 1000, i }' | xargs touch)
+	(cd $tree && find $tree -type f) > $tmp/list$1
+}
+
+# time until the first run, and until a change to the last file is seen
+
+function bench_startup {
+	local n=$1 last t0 t1 rss_one
+	last=$(tail -1 $tmp/list$n)
+
+	echo $tmp/list$n | env $(backend_env) ./entr -np true &
+	bgpid=$! ; sleep 0.5
+	rss_one=$(rss_kb)
+	stop_entr
+
+	t0=$(now_us)
+	start_entr $tmp/list$n
+	if ! wait_runs 1; then
+		report "startup" "\"files\":$n,\"error\":\"$(head -1 $tmp/entr.err)\""
+		stop_entr
+		return 1
+	fi
+	t1=$(tail -1 $tmp/runs)
+	# registration continues after the first run
+	while [ $(runs) -lt 2 ] && kill -0 $bgpid 2> /dev/null; do
+		echo 1 >> $last
+		sleep 0.05
+	done
+	wait_runs 2
+	report "startup" "\"files\":$n,\"startup_ms\":$(ms $(( t1 - t0 ))),\"ready_ms\":$(ms $(( $(tail -1 $tmp/runs) - t0 )))"
+	report "memory" "\"files\":$n,\"rss_kb\":$(rss_kb),\"bytes_per_file\":$(( ($(rss_kb) - rss_one) * 1024 / n )),\"watches\":$(watches)"
+
+	bench_idle $n
+	bench_latency $n
+	stop_entr
+}
+
+# CPU consumed by a process that has nothing to do
+
+function bench_idle {
+	local c0=$(cpu_ms)
+	sleep $idle
+	report "idle" "\"files\":$1,\"seconds\":$idle,\"cpu_ms\":$(awk "BEGIN { print $(cpu_ms) - $c0 }")"
+}
+
+# time from a write to a file under watch until the utility is started, and
+# the time taken to start the utility, which should not grow with the number
+# of files under watch. Polling also reports the time taken by each scan
+
+function bench_latency {
+	local n=$1 i f t0 count
+	for i in $(seq $iterations); do
+		f=$(sed -n "$(( (i * 7919) % n + 1 ))p" $tmp/list$n)
+		count=$(runs)
+		sleep 0.1
+		t0=$(now_us)
+		echo $i >> $f
+		wait_runs $(( count + 1 )) || break
+		echo $(( $(tail -1 $tmp/runs) - t0 ))
+	done > $tmp/latency.out
+	report "latency" "\"files\":$n,\"iterations\":$iterations,$(percentiles < $tmp/latency.out)"
+	sed -n 's/.*"type":"fork".*"spawn_us":\([0-9]*\).*/\1/p' $tmp/trace > $tmp/spawn.out
+	report "spawn" "\"files\":$n,\"runs\":$(wc -l < $tmp/spawn.out | tr -d ' '),$(percentiles < $tmp/spawn.out)"
+	[ $backend = poll ] || return 0
+	sed -n 's/.*"type":"scan".*"scan_us":\([0-9]*\).*/\1/p' $tmp/trace > $tmp/scan.out
+	report "scan" "\"files\":$n,\"scans\":$(wc -l < $tmp/scan.out | tr -d ' '),$(percentiles < $tmp/scan.out)"
+}
+
+# number of runs triggered by common write patterns
+
+function bench_burst {
+	local pattern=$1 debounce=$2 writes=0 f
+	ENTR_DEBOUNCE=$debounce start_entr $tmp/list1000 -p
+	sleep 0.5
+	case $pattern in
+		burst)
+			# a build or checkout that touches many files at once
+			for f in $(head -100 $tmp/list1000); do echo 1 >> $f; done
+			writes=100 ;;
+		rewrite)
+			# a formatter that writes the same file several times
+			f=$(head -1 $tmp/list1000)
+			for i in $(seq 10); do echo $i >> $f; done
+			writes=10 ;;
+		stream)
+			# a steady series of writes such as rsync
+			for f in $(head -50 $tmp/list1000); do echo 1 >> $f; sleep 0.02; done
+			writes=50 ;;
+	esac
+	sleep $(awk "BEGIN { print 1 + $debounce * 10 / 1000 }")
+	report "runs" "\"pattern\":\"$pattern\",\"debounce_ms\":$debounce,\"writes\":$writes,\"runs\":$(runs)"
+	stop_entr
+}
+
+for backend in $backends; do
+	for n in $sizes; do
+		make_tree $n
+		bench_startup $n
+	done
+	make_tree 1000
+	for pattern in burst rewrite stream; do
+		bench_burst $pattern 0
+		bench_burst $pattern 200
+	done
+done
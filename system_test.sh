@@ -117,7 +117,8 @@ try "install default status script"
 	bgpid=$! ; zz
 	wait $bgpid
 	assert "$(cat $tmp/exec.err)" ""
-	assert "$(cat $tmp/exec.out)" "$(printf "entr: created '$tmp/status.awk'\ntrue returned exit code 0\n")"
+	sed -i -E -e 's/ in [0-9.]+s \([0-9.]+s user, [0-9.]+s sys, [0-9]+ KiB max rss, [0-9]+\+[0-9]+ context switches\)$/ .../' $tmp/exec.out
+	assert "$(cat $tmp/exec.out)" "$(printf "entr: created '$tmp/status.awk'\ntrue returned exit code 0 ...\n")"
 
 try "status script not compatible with restart option"
 	setup
@@ -173,6 +174,19 @@ try "use custom status script with shell option and kill"
 	assert "$(cat $tmp/exec.err)" ""
 	assert "$(cat $tmp/exec.out)" "$(printf '= signal 9 =')"
 
+try "report the resources used by each run to the status script"
+	setup
+	export ENTR_STATUS_SCRIPT="$tmp/status.awk"
+	cat > $ENTR_STATUS_SCRIPT <<-'EOF'
+	{
+	  print NF, ($4 >= 200), ($7 > 0)
+	}
+	EOF
+	ls $tmp/* | entr -zx sleep 0.2 >$tmp/exec.out 2>$tmp/exec.err &
+	bgpid=$! ; zz ; zz
+	assert "$(cat $tmp/exec.err)" ""
+	assert "$(cat $tmp/exec.out)" "9 1 1"
+
 try "abort if status script terminates"
 	setup
 	export ENTR_STATUS_SCRIPT="$tmp/status.awk"
@@ -203,6 +217,28 @@ try "spacebar triggers utility"
 	tmux send-keys -t $tsession:0 "q" ; zz
 	tmux kill-session -t $tsession
 
+try "spacebar triggers utility while following input"
+	setup
+	env SHELL=/bin/sh tmux new-session -s $tsession -d
+	echo "waiting" > $tmp/file1
+	echo "finished" > $tmp/file2
+	tmux send-keys -t $tsession:0 \
+	    "(echo $tmp/file2; sleep 5) | ./entr -fp cp $tmp/file2 $tmp/file1" C-m ; zz
+	assert "$(cat $tmp/file1)" "waiting"
+	tmux send-keys -t $tsession:0 " " ; zz
+	assert "$(cat $tmp/file1)" "finished"
+	tmux send-keys -t $tsession:0 "q" ; zz
+	tmux kill-session -t $tsession
+
+try "quit while the utility is running"
+	setup
+	env SHELL=/bin/sh tmux new-session -s $tsession -d
+	tmux send-keys -t $tsession:0 \
+	    "ls $tmp/file2 | ./entr sh -c 'sleep 10'; echo exited > $tmp/file1" C-m ; zz
+	tmux send-keys -t $tsession:0 "q" ; zz
+	assert "$(cat $tmp/file1)" "exited"
+	tmux kill-session -t $tsession
+
 # file system tests
 
 try "exec a command using one-shot option"
@@ -253,6 +289,17 @@ try "restart a server when a file is modified using one-shot option"
 		assert "$(cat $tmp/exec.out)" "123"
 	fi
 
+try "watch files listed on standard input after startup"
+	setup
+	(echo $tmp/file1; sleep 0.5; echo $tmp/file2; sleep 2) | \
+	    entr -fp sh -c 'echo changed; cat' >$tmp/exec.out 2>$tmp/exec.err &
+	bgpid=$! ; sleep 1
+	echo 456 >> $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.err)" ""
+	assert "$(cat $tmp/exec.out)" "changed"
+
 try "exec a command in non-intertive mode"
 	setup
 	ls $tmp/file* | entr tty >$tmp/exec.out &
@@ -319,6 +366,59 @@ try "exec single shell utility and exit when a file is added to a specific path"
 	assert "$(cat $tmp/exec.out)" "ping"
 	assert "$(cat $tmp/exec.err)" "entr: directory altered"
 
+try "exec single utility and exit when a file in a directory is renamed"
+	setup
+	ls -d $tmp | EV_TRACE=1 entr -p echo ping >$tmp/exec.out 2>$tmp/exec.err \
+	    || true &
+	bgpid=$! ; zz
+	mv $tmp/file2 $tmp/file3
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "ping"
+	assert "$(grep -e '^added' -e '^removed' $tmp/exec.err | sort)" \
+	    "$(printf 'added: %s\nremoved: %s' $tmp/file3 $tmp/file2)"
+	assert "$(tail -1 $tmp/exec.err)" "entr: directory altered"
+
+try "ignore a temporary file that is removed from a directory"
+	setup
+	ls -d $tmp | entr -p echo ping >$tmp/exec.out 2>$tmp/exec.err &
+	bgpid=$! ; zz
+	touch $tmp/file3 ; rm $tmp/file3 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" ""
+	assert "$(cat $tmp/exec.err)" ""
+
+try "exec utility when a file in a subdirectory is changed using recursive option"
+	setup
+	mkdir -p $tmp/tree/a/b
+	touch $tmp/tree/a/b/file3
+	echo $tmp/tree | entr -npR echo changed > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/tree/a/b/file3 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	rm -r $tmp/tree
+	assert "$(cat $tmp/exec.out)" "changed"
+
+try "track files added and removed using recursive option without exiting"
+	setup
+	mkdir -p $tmp/tree/a $tmp/tree/.git
+	touch $tmp/tree/file3 $tmp/tree/a/file4 $tmp/tree/.git/index
+	echo $tmp/tree | EV_TRACE=1 entr -npR echo changed > $tmp/exec.out \
+	    2>$tmp/exec.err &
+	bgpid=$! ; zz
+	mkdir -p $tmp/tree/b/c ; zz
+	touch $tmp/tree/b/c/file5 ; zz
+	echo 456 >> $tmp/tree/b/c/file5 ; zz
+	rm -r $tmp/tree/a ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	rm -r $tmp/tree
+	assert "$(grep '^n_files' $tmp/exec.err | head -1)" "n_files: 4"
+	assert "$(grep '^n_files' $tmp/exec.err | tail -1)" "n_files: 5"
+	assert "$(grep -m1 -o '/tree/b/c/file5$' $tmp/exec.err)" "/tree/b/c/file5"
+	assert "$(grep -c 'directory altered' $tmp/exec.err)" "0"
+
 try "exec utility when a symlink is changed"
 	setup
 	ln -sf $tmp/file1 $tmp/link
@@ -410,6 +510,311 @@ try "exec single utility when an entire stash of files is reverted"
 		assert "$(cat $tmp/exec.out)" "changed"
 	fi
 
+try "memory used for each watched file"
+	if [ ! -r /proc/self/status ]; then
+		skip "procfs not available"
+	else
+		setup
+		mkdir $tmp/many
+		(cd $tmp/many && seq 5000 | xargs touch)
+		ls $tmp/file1 | entr -p true &
+		bgpid=$! ; zz
+		rss_one=$(awk '/^VmRSS/ { print $2 }' /proc/$bgpid/status)
+		kill -INT $bgpid
+		wait $bgpid; assert "$?" "0"
+		ls $tmp/many/* | entr -p true &
+		bgpid=$! ; zz
+		rss_many=$(awk '/^VmRSS/ { print $2 }' /proc/$bgpid/status)
+		kill -INT $bgpid
+		wait $bgpid; assert "$?" "0"
+		rm -r $tmp/many
+		# kB to bytes for each file
+		assert "$(( (rss_many - rss_one) * 1024 / 5000 < 1024 ))" "1"
+	fi
+
+try "watch each path and inode once"
+	setup
+	ln $tmp/file1 $tmp/link1
+	printf "$tmp/file1\n$tmp/file2\n$tmp/file1\n$tmp/link1\n" | \
+	    EV_TRACE=1 entr -dz true 2>$tmp/exec.err
+	assert "$?" "0"
+	assert "$(grep n_files $tmp/exec.err)" "n_files: 3"
+
+try "use the first file listed as the default when many files are listed"
+	setup
+	mkdir $tmp/many
+	(cd $tmp/many && seq 2000 | xargs touch)
+	ls $tmp/many/* | sort -r | entr -z -s 'echo $0' >$tmp/exec.out 2>$tmp/exec.err
+	assert "$?" "0"
+	rm -r $tmp/many
+	assert "$(cat $tmp/exec.err)" ""
+	assert "$(cat $tmp/exec.out)" "$tmp/many/999"
+
+try "read a burst of events in one pass"
+	setup
+	mkdir $tmp/many
+	(cd $tmp/many && seq 2000 | xargs touch)
+	ls $tmp/many/* | EV_TRACE=1 entr -p sleep 1 2>$tmp/exec.err &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/many/1 ; zz
+	kill -STOP $bgpid
+	for f in $tmp/many/*; do echo 456 >> $f; done
+	kill -CONT $bgpid
+	sleep 1.5
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	rm -r $tmp/many
+	assert "$(grep -c '^batch: 2000 events' $tmp/exec.err)" "1"
+
+try "reject an unknown event backend"
+	setup
+	ls $tmp/file1 | ENTR_BACKEND=poll entr true 2> $tmp/exec.err
+	assert "$?" "1"
+	assert "$(cat $tmp/exec.err)" "entr: unknown backend: poll"
+
+try "exec utility when a file is written using fanotify"
+	setup
+	if ! (ls $tmp/file1 | ENTR_BACKEND=fanotify entr -z true 2>/dev/null); then
+		skip "fanotify not available"
+	else
+		ls $tmp/file* | ENTR_BACKEND=fanotify entr -p echo changed > $tmp/exec.out &
+		bgpid=$! ; zz
+		echo 456 >> $tmp/file2 ; zz
+		kill -INT $bgpid
+		wait $bgpid; assert "$?" "0"
+		assert "$(cat $tmp/exec.out)" "changed"
+	fi
+
+try "exec utility and exit when a file is added to a directory using fanotify"
+	setup
+	if ! (ls $tmp/file1 | ENTR_BACKEND=fanotify entr -z true 2>/dev/null); then
+		skip "fanotify not available"
+	else
+		ls -d $tmp | ENTR_BACKEND=fanotify entr -dp echo changed >$tmp/exec.out \
+		    2>$tmp/exec.err || true &
+		bgpid=$! ; zz
+		touch $tmp/newfile
+		wait $bgpid; assert "$?" "0"
+		assert "$(cat $tmp/exec.out)" "changed"
+		assert "$(cat $tmp/exec.err)" "entr: directory altered"
+	fi
+
+try "exec utility when files sharing a directory watch are written and replaced"
+	setup
+	if [ $(uname) != 'Linux' ]; then
+		skip "inotify not available"
+	else
+		ls $tmp/file* | ENTR_BACKEND=inotify-dir EV_TRACE=1 entr -p echo changed \
+		    >$tmp/exec.out 2>$tmp/exec.err &
+		bgpid=$! ; zz
+		echo 456 >> $tmp/file2 ; zz
+		echo 789 > $tmp/file1.new
+		mv $tmp/file1.new $tmp/file1 ; zz
+		echo 012 >> $tmp/file1 ; zz
+		kill -INT $bgpid
+		wait $bgpid; assert "$?" "0"
+		assert "$(cat $tmp/exec.out)" "$(printf 'changed\nchanged\nchanged')"
+		assert "$(grep '^inotify:' $tmp/exec.err | tail -1 | grep -o '[0-9]* watches')" \
+		    "1 watches"
+	fi
+
+try "exec utility for each write separated by a pause"
+	setup
+	ls $tmp/file* | entr -p echo changed > $tmp/exec.out &
+	bgpid=$! ; zz
+	for n in 1 2 3; do echo $n >> $tmp/file1 ; zz ; done
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(grep -c changed $tmp/exec.out)" "3"
+
+try "exec utility once for a series of writes using debounce"
+	setup
+	ls $tmp/file* | ENTR_DEBOUNCE=500 entr -p echo changed > $tmp/exec.out &
+	bgpid=$! ; zz
+	for n in 1 2 3 4; do echo $n >> $tmp/file$((n % 2 + 1)) ; sleep 0.1 ; done
+	sleep 1
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(grep -c changed $tmp/exec.out)" "1"
+
+try "exec utility during a steady stream of writes using debounce"
+	setup
+	ls $tmp/file* | ENTR_DEBOUNCE=300 ENTR_DEBOUNCE_MAX=600 entr -p echo changed \
+	    > $tmp/exec.out &
+	bgpid=$! ; zz
+	for n in $(seq 16); do echo $n >> $tmp/file1 ; sleep 0.1 ; done
+	sleep 1
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	runs=$(grep -c changed $tmp/exec.out)
+	assert "$(( runs >= 2 && runs <= 4 ))" "1"
+
+try "reject an invalid debounce interval"
+	setup
+	ls $tmp/file1 | ENTR_DEBOUNCE=1s entr true 2> $tmp/exec.err
+	assert "$?" "1"
+	assert "$(cat $tmp/exec.err)" "entr: invalid ENTR_DEBOUNCE: 1s"
+
+try "write structured trace records to a descriptor"
+	setup
+	echo 123 > $tmp/file1
+	ls $tmp/file1 | ENTR_TRACE_FD=3 entr -ip echo changed > $tmp/exec.out 3> $tmp/trace.out &
+	bgpid=$! ; zz
+	echo 123 > $tmp/file1 ; zz
+	echo 456 > $tmp/file1 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "changed"
+	assert "$(grep -c '"type":"fork","pid":[0-9]*,"latency_us":' $tmp/trace.out)" "1"
+	assert "$(grep -c '"type":"exit","pid":[0-9]*,"status":0,' $tmp/trace.out)" "1"
+	assert "$(grep -c '"user_us":[0-9]*,"sys_us":[0-9]*,"maxrss_kb":[1-9]' $tmp/trace.out)" "1"
+	assert "$(grep -c '"decision":"unchanged","path":"'$tmp/file1'"' $tmp/trace.out)" "1"
+	assert "$(grep -o '"runs":[0-9]*,"deferred":0,"unchanged":1' $tmp/trace.out)" \
+	    '"runs":1,"deferred":0,"unchanged":1'
+
+try "ignore writes that leave contents unchanged"
+	setup
+	echo 123 > $tmp/file1
+	ls $tmp/file* | entr -ip echo changed > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 123 > $tmp/file1 ; zz
+	touch $tmp/file1 $tmp/file2 ; zz
+	echo 456 > $tmp/file1 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "changed"
+
+try "ignore a file replaced with identical contents"
+	setup
+	echo 123 > $tmp/file1
+	ls $tmp/file* | entr -ip echo /_ > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 123 > $tmp/file1.tmp ; mv $tmp/file1.tmp $tmp/file1 ; zz
+	echo 456 > $tmp/file2.tmp ; mv $tmp/file2.tmp $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$tmp/file2"
+
+try "continue to watch a large file that is truncated while it is fingerprinted"
+	setup
+	ls $tmp/file* | entr -ip echo changed > $tmp/exec.out &
+	bgpid=$! ; zz
+	for i in 1 2 3 4 5 6 7 8; do
+		head -c 67108864 /dev/zero > $tmp/file1 ; sleep 0.02 ; : > $tmp/file1 ; sleep 0.05
+	done ; zz
+	echo 456 > $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(tail -1 $tmp/exec.out)" "changed"
+
+try "provide the list of changed files to the utility"
+	setup
+	ls $tmp/file* | entr -pl sh -c 'cat <&$ENTR_CHANGED_FD' > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; echo 456 >> $tmp/file1 ; echo 789 >> $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf '%s\n' $tmp/file1 $tmp/file2)"
+
+try "provide a list of changed files larger than the argument limit"
+	setup
+	mkdir $tmp/many
+	(cd $tmp/many && seq -f "%0100g" 4000 | xargs touch)
+	ls $tmp/many/* | ENTR_DEBOUNCE=500 entr -pl sh -c 'wc -l <&$ENTR_CHANGED_FD' \
+	    > $tmp/exec.out &
+	bgpid=$! ; zz
+	for f in $tmp/many/*; do echo 456 >> $f; done
+	sleep 1
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	rm -r $tmp/many
+	assert "$(cat $tmp/exec.out | tr -d ' ')" "4000"
+
+try "list files added and removed from a recursive tree"
+	setup
+	mkdir -p $tmp/tree/a
+	touch $tmp/tree/a/file3
+	echo $tmp/tree | entr -pRl sh -c 'cat <&$ENTR_CHANGED_FD' > $tmp/exec.out &
+	bgpid=$! ; zz
+	mv $tmp/tree/a/file3 $tmp/tree/file4 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	rm -r $tmp/tree
+	assert "$(sort -u $tmp/exec.out)" "$(printf '%s\n' $tmp/tree/a/file3 $tmp/tree/file4)"
+
+try "write each set of changes to a persistent utility"
+	setup
+	cat > $tmp/worker.sh <<-'EOF'
+	echo started
+	while read seq n; do
+		echo "$seq $n"
+		for i in $(seq $n); do read path; echo $path; done
+	done
+	EOF
+	ls $tmp/file* | ENTR_DEBOUNCE=100 entr -w sh $tmp/worker.sh > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; zz
+	echo 456 >> $tmp/file1 ; echo 789 >> $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" \
+	    "$(printf 'started\n1 1\n%s\n2 2\n%s\n%s' $tmp/file2 $tmp/file1 $tmp/file2)"
+
+try "start a persistent utility again after it exits"
+	setup
+	ls $tmp/file* | entr -pw sh -c 'read seq n; read path; echo $seq $path' > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; zz
+	echo 456 >> $tmp/file1 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf '1 %s\n2 %s' $tmp/file2 $tmp/file1)"
+
+try "run the commands selected by a table of routes"
+	setup
+	cat > $tmp/routes <<-'EOF'
+	# pattern	command
+	*/file1	echo one $0
+	*/file2	echo two $0
+	*/file3	echo two $0
+	EOF
+	touch $tmp/file3
+	ls $tmp/file* | ENTR_JOBS=2 entr -pt $tmp/routes > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; zz
+	echo 456 >> $tmp/file1 ; zz
+	echo 456 >> $tmp/file3 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" \
+	    "$(printf 'two %s\none %s\ntwo %s' $tmp/file2 $tmp/file1 $tmp/file3)"
+
+try "run a route once more for changes made while it is running"
+	setup
+	cat > $tmp/routes <<-'EOF'
+	*	sleep 0.5; cat <&$ENTR_CHANGED_FD
+	EOF
+	ls $tmp/file* | ENTR_JOBS=1 entr -plt $tmp/routes > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; zz
+	echo 456 >> $tmp/file1 ; echo 789 >> $tmp/file2 ; zz
+	sleep 1
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf '%s\n' $tmp/file2 $tmp/file1 $tmp/file2)"
+
+try "pass the first changed path to a route along with the list of changed files"
+	setup
+	cat > $tmp/routes <<-'EOF'
+	*	echo $0; cat <&$ENTR_CHANGED_FD
+	EOF
+	ls $tmp/file* | entr -plt $tmp/routes > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; echo 456 >> $tmp/file1 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf '%s\n' $tmp/file1 $tmp/file1 $tmp/file2)"
+
 try "exec utility when a file is written by Vim"
 	setup
 	ls $tmp/file* | entr -p echo "changed" > $tmp/exec.out &
@@ -469,6 +874,42 @@ try "ensure that all shell subprocesses are terminated with custom signal in res
 	kill -INT $bgpid ; zz
 	assert "$(cat $tmp/exec.out)" "$(printf 'running\ncaught signal')"
 
+try "kill a server that ignores the restart signal after a timeout"
+	setup
+	cat <<-SCRIPT > $tmp/go.sh
+	#!/bin/sh
+	trap '' TERM
+	echo "running"; sleep 10
+	SCRIPT
+	chmod +x $tmp/go.sh
+	ls $tmp/file2 | ENTR_RESTART_TIMEOUT=200 ENTR_TRACE_FD=3 entr -r $tmp/go.sh \
+	    2> /dev/null > $tmp/exec.out 3> $tmp/trace.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; zz ; zz
+	assert "$(cat $tmp/exec.out)" "$(printf 'running\nrunning')"
+	echo 789 >> $tmp/file2 ; zz ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf 'running\nrunning\nrunning')"
+	assert "$(grep -c '"type":"kill"' $tmp/trace.out)" "2"
+
+try "stop the utility once when a second signal arrives while exiting"
+	setup
+	cat <<-SCRIPT > $tmp/go.sh
+	#!/bin/sh
+	trap '' TERM
+	echo "running"; sleep 10
+	SCRIPT
+	chmod +x $tmp/go.sh
+	ls $tmp/file2 | ENTR_RESTART_TIMEOUT=500 ENTR_TRACE_FD=3 entr -r $tmp/go.sh \
+	    2> /dev/null > $tmp/exec.out 3> $tmp/trace.out &
+	bgpid=$! ; zz
+	kill -INT $bgpid ; sleep 0.1 ; kill -TERM $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "running"
+	assert "$(grep -c '"type":"exit".*"signal":9' $tmp/trace.out)" "1"
+	assert "$(grep -c '"type":"stats"' $tmp/trace.out)" "1"
+
 try "ensure that all shell subprocesses are terminated when terminal is closed"
 	setup
 	cat <<-SCRIPT > $tmp/go.sh
@@ -564,6 +1005,15 @@ try "watch and exec a program that is overwritten"
 	wait $bgpid; assert "$?" "0"
 	assert "$(cat $tmp/exec.out)" "vroom"
 
+try "exec a script without an interpreter found using PATH"
+	setup
+	mkdir $tmp/bin
+	echo 'echo "vroom $1"' > $tmp/bin/script; chmod 755 $tmp/bin/script
+	ls $tmp/file1 | PATH=$tmp/bin:$PATH entr -z script /_ > $tmp/exec.out
+	assert "$?" "0"
+	rm -r $tmp/bin
+	assert "$(cat $tmp/exec.out)" "vroom $tmp/file1"
+
 try "exec an interactive utility when a file changes"
 	setup
 	if ! test -t 0 ; then
@@ -607,6 +1057,17 @@ try "respond to events that occur while the utility is running"
 	wait $bgpid; assert "$?" "0"
 	assert "$(cat $tmp/exec.out)" "$(printf 'vroom\nvroom\n')"
 
+try "run once more for all of the events that occur while the utility is running"
+	setup
+	ls $tmp/file* | entr -a sh -c 'echo "vroom"; sleep 1' > $tmp/exec.out &
+	bgpid=$! ; zz
+	echo "123" > $tmp/file1 ; zz
+	echo "456" > $tmp/file2
+	sleep 2
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf 'vroom\nvroom\n')"
+
 try "ensure that all subprocesses are terminated in restart mode when a file is removed"
 	setup
 	cat <<-SCRIPT > $tmp/go.sh
@@ -619,7 +1080,93 @@ try "ensure that all subprocesses are terminated in restart mode when a file is
 	bgpid=$! ; zz
 	rm $tmp/file2; sleep 2
 	pgrep -P $bgpid > /dev/null || assert "$?" "1"
-	assert "$(cat $tmp/exec.out)" "$(printf 'running\ncaught signal')"
+	assert "$(sort $tmp/exec.out)" "$(printf 'caught signal\nrunning\nrunning')"
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+
+try "restart the utility in restart mode when a file is removed and when it reappears"
+	setup
+	cat <<-SCRIPT > $tmp/go.sh
+	#!/bin/sh
+	trap 'echo "caught signal"; exit' TERM
+	echo "running"; sleep 10
+	SCRIPT
+	chmod +x $tmp/go.sh
+	ls $tmp/file2 | entr -r $tmp/go.sh 2> /dev/null > $tmp/exec.out &
+	bgpid=$! ; zz
+	rm $tmp/file2; sleep 2
+	assert "$(cat $tmp/exec.out)" "$(printf 'running\ncaught signal\nrunning')"
+	echo 456 > $tmp/file2.tmp ; mv $tmp/file2.tmp $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	pgrep -P $bgpid > /dev/null || assert "$?" "1"
+	assert "$(cat $tmp/exec.out)" \
+	    "$(printf 'running\ncaught signal\nrunning\ncaught signal\nrunning\ncaught signal')"
+
+try "continue to watch a file that is removed until it reappears"
+	setup
+	ls $tmp/file* | ENTR_TRACE_FD=3 entr -p echo changed > $tmp/exec.out 3> $tmp/trace.out &
+	bgpid=$! ; zz
+	rm $tmp/file2; sleep 1.5
+	assert "$(cat $tmp/exec.out)" "changed"
+	echo 123 > $tmp/file1 ; zz
+	assert "$(cat $tmp/exec.out)" "$(printf 'changed\nchanged')"
+	echo 456 > $tmp/file2.tmp ; mv $tmp/file2.tmp $tmp/file2 ; zz
+	assert "$(cat $tmp/exec.out)" "$(printf 'changed\nchanged\nchanged')"
+	echo 789 >> $tmp/file2 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf 'changed\nchanged\nchanged\nchanged')"
+	assert "$(grep -c '"type":"absent","path":"'$tmp/file2'"' $tmp/trace.out)" "1"
+
+try "forget a file in a recursive tree that is removed while it is waiting to be opened again"
+	setup
+	mkdir -p $tmp/tree
+	touch $tmp/tree/file3 $tmp/tree/file4
+	echo $tmp/tree | ENTR_TRACE_FD=3 entr -npR echo changed > $tmp/exec.out \
+	    3> $tmp/trace.out &
+	bgpid=$! ; zz
+	ln -s $tmp/missing $tmp/tree/file3.tmp ; mv $tmp/tree/file3.tmp $tmp/tree/file3 ; zz
+	rm $tmp/tree/file3 ; sleep 1.5
+	runs=$(wc -l < $tmp/exec.out)
+	echo 456 >> $tmp/tree/file4 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	rm -r $tmp/tree
+	assert "$(( $(wc -l < $tmp/exec.out) - runs ))" "1"
+	assert "$(grep -c '"type":"absent"' $tmp/trace.out)" "0"
+
+try "skip the first run if no file changed since the last session"
+	setup
+	ls $tmp/file* | ENTR_INDEX=$tmp/index entr -z echo changed > $tmp/exec.out
+	assert "$?" "0"
+	ls $tmp/file* | ENTR_INDEX=$tmp/index ENTR_TRACE_FD=3 entr -z echo changed \
+	    >> $tmp/exec.out 3> $tmp/trace.out &
+	bgpid=$! ; zz
+	assert "$(cat $tmp/exec.out)" "changed"
+	echo 456 >> $tmp/file2 ; zz
+	wait $bgpid; assert "$?" "0"
+	assert "$(grep -c '"type":"index","files":2,"changed":0' $tmp/trace.out)" "1"
+	echo 789 >> $tmp/file1
+	ls $tmp/file* | ENTR_INDEX=$tmp/index ENTR_TRACE_FD=3 entr -z echo changed \
+	    >> $tmp/exec.out 3> $tmp/trace.out
+	assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf 'changed\nchanged\nchanged')"
+	assert "$(grep -c '"type":"index","files":2,"changed":1' $tmp/trace.out)" "1"
+
+try "poll files using stat at an interval"
+	setup
+	ls $tmp/file* | ENTR_POLL=all ENTR_POLL_INTERVAL=20 ENTR_TRACE_FD=3 entr -p echo changed \
+	    > $tmp/exec.out 3> $tmp/trace.out &
+	bgpid=$! ; zz
+	echo 456 >> $tmp/file2 ; zz
+	assert "$(cat $tmp/exec.out)" "changed"
+	echo 789 > $tmp/file1.tmp ; mv $tmp/file1.tmp $tmp/file1 ; zz
+	kill -INT $bgpid
+	wait $bgpid; assert "$?" "0"
+	assert "$(cat $tmp/exec.out)" "$(printf 'changed\nchanged')"
+	assert "$(grep -c '"type":"scan","files":2,"changed":1' $tmp/trace.out)" "2"
+	assert "$(grep -c '"polled":2' $tmp/trace.out)" "1"
 
 this="exit 0"
 echo
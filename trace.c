@@ -0,0 +1,139 @@
+/*
+ * trace.c
+ * structured trace records written as JSON lines
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* globals */
+int trace_fd = -1;
+
+/*
+ * Begin writing records to the descriptor named by ENTR_TRACE_FD. The
+ * descriptor is not passed on to the utility
+ */
+void
+trace_open(const char *fd) {
+	char *end;
+	long n;
+
+	if ((fd == NULL) || (*fd == '\0'))
+		return;
+	errno = 0;
+	n = strtol(fd, &end, 10);
+	if ((errno != 0) || (*end != '\0') || (n < 0) || (n > INT_MAX))
+		errx(1, "invalid ENTR_TRACE_FD: %s", fd);
+	if (fcntl((int) n, F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "ENTR_TRACE_FD %ld", n);
+	trace_fd = (int) n;
+}
+
+/* monotonic time in microseconds */
+uint64_t
+trace_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Write one record. fmt supplies the fields that follow the timestamp and
+ * type. Each record is written using a single call so that it is not
+ * interleaved with output from a child process
+ */
+void
+trace_write(const char *type, const char *fmt, ...) {
+	char buf[4096];
+	va_list ap;
+	int len, n;
+
+	if (trace_fd == -1)
+		return;
+	len = snprintf(buf, sizeof(buf), "{\"t_us\":%llu,\"type\":\"%s\"",
+	    (unsigned long long) trace_now(), type);
+	if ((fmt != NULL) && (*fmt != '\0')) {
+		buf[len++] = ',';
+		va_start(ap, fmt);
+		n = vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+		va_end(ap);
+		if ((n < 0) || ((size_t) n >= sizeof(buf) - len - 2))
+			n = snprintf(buf + len, sizeof(buf) - len, "\"truncated\":true");
+		len += n;
+	}
+	buf[len++] = '}';
+	buf[len++] = '\n';
+	write(trace_fd, buf, len);
+}
+
+/*
+ * Format a JSON string, truncating it if it does not fit. Returns buf
+ */
+const char *
+trace_string(char *buf, size_t size, const char *s) {
+	const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t len = 0;
+
+	buf[len++] = '"';
+	for (; (c = *s) != '\0' && (len + 7 < size); s++) {
+		if ((c == '"') || (c == '\\')) {
+			buf[len++] = '\\';
+			buf[len++] = c;
+		} else if (c < 0x20) {
+			buf[len++] = '\\';
+			buf[len++] = 'u';
+			buf[len++] = '0';
+			buf[len++] = '0';
+			buf[len++] = hex[c >> 4];
+			buf[len++] = hex[c & 0xf];
+		} else
+			buf[len++] = c;
+	}
+	buf[len++] = '"';
+	buf[len] = '\0';
+	return buf;
+}
+
+void
+trace_hist_add(Histogram *h, uint64_t us) {
+	int i;
+
+	for (i = 0; (i < TRACE_BUCKETS - 1) && (us >= (1ULL << i)); i++)
+		;
+	h->count[i]++;
+	h->n++;
+	if (us > h->max)
+		h->max = us;
+}
+
+/*
+ * Format a histogram as a list of [upper bound, count] pairs, leaving out
+ * empty buckets. Returns the length of the string
+ */
+int
+trace_hist_format(char *buf, size_t size, const Histogram *h) {
+	size_t len = 0;
+	int i;
+
+	len += snprintf(buf + len, size - len, "[");
+	for (i = 0; (i < TRACE_BUCKETS) && (len + 32 < size); i++) {
+		if (h->count[i] == 0)
+			continue;
+		len += snprintf(buf + len, size - len, "%s[%llu,%lu]", (len > 1) ? "," : "",
+		    1ULL << i, h->count[i]);
+	}
+	len += snprintf(buf + len, size - len, "]");
+	return len;
+}
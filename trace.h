@@ -0,0 +1,22 @@
+/*
+ * trace.h
+ * structured trace records written as JSON lines
+ */
+
+#define TRACE_BUCKETS 32
+
+/* log2 histogram of durations in microseconds */
+typedef struct {
+	unsigned long count[TRACE_BUCKETS];
+	unsigned long n;
+	uint64_t max;
+} Histogram;
+
+void trace_open(const char *fd);
+uint64_t trace_now(void);
+void trace_write(const char *type, const char *fmt, ...);
+const char *trace_string(char *buf, size_t size, const char *s);
+void trace_hist_add(Histogram *h, uint64_t us);
+int trace_hist_format(char *buf, size_t size, const Histogram *h);
+
+extern int trace_fd;